@@ -45,7 +45,7 @@ addUser(char *username, char *password, struct inode* account)
     return 0;
   strncpy(utable.user[i][0], username, MAXUSERNAME);
   strncpy(utable.user[i][1], password, MAXPASSWORD);
-  max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+  max = MAXOPWRITE;
   addr = (char*)utable.user;
   n = 320;
   i = off = 0;
@@ -76,7 +76,7 @@ deleteUser(char *username, struct inode* account)
     if(strncmp(utable.user[i][0], username, MAXUSERNAME) == 0){
       memset(utable.user[i][0], 0, MAXUSERNAME);
       memset(utable.user[i][1], 0, MAXPASSWORD);
-      max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+      max = MAXOPWRITE;
       addr = (char*)utable.user;
       n = 320;
       i = off = 0;
@@ -131,7 +131,7 @@ setuser(struct inode* account)
   strncpy(utable.user[0][1], "0000", MAXPASSWORD);
   utable.cnt = 1;
 
-  max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
+  max = MAXOPWRITE;
   addr = (char*)utable.user;
   n = 320;
   i = off = 0;
@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -13,83 +13,396 @@
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 //
+// To have several blocks in flight at once:
+// * bread_async is bread that may return before the data is
+//     there, and bwrite_async is bwrite that does not wait.
+// * bsubmit starts I/O on a batch of locked buffers: a write
+//     for each with B_DIRTY set, a read for each without B_VALID.
+// * Call bwait before using the data of, or releasing, a buffer
+//     given to any of them.
+// * breadahead starts reads that no one waits for.
+//
 // The implementation uses two state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Buffers are found through a hash table keyed by (dev, blockno)
+// whose buckets each have their own lock, so finding a cached
+// block takes no global lock.  The cache starts out empty and
+// grows a page of buffers at a time, up to 1/BCACHEFRAC of memory.
+//
+// Replacement follows 2Q.  A block read in for the first time
+// goes on the A1 queue, which is FIFO: hits leave it in place, so
+// a one-time scan of a big file only cycles through A1.  When a
+// block leaves A1 its key is remembered on the ghost list, and if
+// it is read again while remembered there it goes on the Am queue
+// instead.  Am holds the blocks that are reused and is run as a
+// clock: a hit just sets b->used, and a buffer whose used bit is
+// set gets another round when the clock passes it.
+//
+// Locking: a bucket's lock protects its chain and the refcnt and
+// used bit of the buffers on it.  bcache.lock protects the queues
+// and the ghost list and is taken before any bucket lock.  Only
+// its holder changes a buffer's dev and blockno, or holds two
+// bucket locks at once.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "memstat.h"
+
+#define NODEV ((uint)-1)  // dev of a ghost slot that is not in use
+#define A1FRAC 4          // A1 is kept to 1/A1FRAC of the buffers
+
+enum { QFREE, QA1, QAM, NQUEUE };
+
+struct queue {
+  struct buf head;  // through prev/next; head.next is newest
+  uint n;
+};
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;  // chain through hnext
+};
+
+// Key of a block recently evicted from A1.
+struct ghost {
+  uint dev;
+  uint blockno;
+  int next;  // hash chain, -1 at the end
+};
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct queue q[NQUEUE];    // QFREE holds never used buffers
+
+  struct ghost *ghost;       // ring, overwritten oldest first
+  int *ghosthead;            // hash chains of ghosts
+  uint nghost;               // a power of two
+  uint ghostpos;             // next ring slot to fill
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  struct bucket *bucket;
+  uint nbucket;              // a power of two
+  uint nbuf;                 // buffers allocated so far
+  uint maxbuf;
+  struct kmem_cache *cache;  // buf structures
+
+  uint hit[NCPU];            // bget() statistics
+  uint miss[NCPU];
 } bcache;
 
+static struct bucket*
+hash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(blockno + dev*7919) & (bcache.nbucket - 1)];
+}
+
+// Allocate zeroed memory for a table at boot.  Only the memory
+// kinit1() freed can be allocated yet, however much kfreepages()
+// promises, so ask for at most the largest block and an eighth
+// of what is free, and less if even that is not there; *n, the
+// number of entries, is halved to fit.
+static void*
+alloctable(uint *n, uint entsize)
+{
+  char *mem;
+  int order;
+
+  for(order = 0; (PGSIZE << order) < *n * entsize; order++)
+    ;
+  for(; order > 0 && (order > MAXORDER || (1 << order) > kfreenow()/8);
+      order--)
+    *n >>= 1;
+  while((mem = kalloc_order(order)) == 0){
+    if(order == 0)
+      panic("binit");
+    order--;
+    *n >>= 1;
+  }
+  memset(mem, 0, PGSIZE << order);
+  return mem;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  uint i, n;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NQUEUE; i++){
+    bcache.q[i].head.prev = &bcache.q[i].head;
+    bcache.q[i].head.next = &bcache.q[i].head;
+  }
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf));
+
+  // A commit holds up to LOGSIZE log buffers and as many home
+  // blocks at once; leave a third as much for everyone else.
+  bcache.maxbuf = kfreepages() / BCACHEFRAC * (PGSIZE/BSIZE);
+  if(bcache.maxbuf < NBUF)
+    bcache.maxbuf = NBUF;
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // About four buffers per bucket once the cache is full.
+  for(n = 1; n*4 < bcache.maxbuf; n <<= 1)
+    ;
+  bcache.bucket = alloctable(&n, sizeof(struct bucket));
+  bcache.nbucket = n;
+  for(i = 0; i < n; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+
+  // Remember about half as many evicted blocks as there are buffers.
+  n = bcache.nbucket * 2;
+  bcache.ghost = alloctable(&n, sizeof(struct ghost) + sizeof(int));
+  bcache.ghosthead = (int*)(bcache.ghost + n);
+  bcache.nghost = n;
+  for(i = 0; i < n; i++){
+    bcache.ghost[i].dev = NODEV;
+    bcache.ghosthead[i] = -1;
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Add b at the head of queue q.
+static void
+qadd(int q, struct buf *b)
+{
+  struct buf *head = &bcache.q[q].head;
+
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+  b->queue = q;
+  bcache.q[q].n++;
+}
+
+// Take b off its queue.
+static void
+qdel(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  bcache.q[b->queue].n--;
+}
+
+static int*
+ghostchain(uint dev, uint blockno)
+{
+  return &bcache.ghosthead[(blockno + dev*7919) & (bcache.nghost - 1)];
+}
+
+// Remember the key of a block evicted from A1,
+// forgetting the oldest one.
+static void
+ghostadd(uint dev, uint blockno)
+{
+  struct ghost *g;
+  int i, *pp;
+
+  i = bcache.ghostpos;
+  bcache.ghostpos = (i + 1) & (bcache.nghost - 1);
+  g = &bcache.ghost[i];
+  if(g->dev != NODEV){
+    for(pp = ghostchain(g->dev, g->blockno); *pp != i;
+        pp = &bcache.ghost[*pp].next)
+      ;
+    *pp = g->next;
+  }
+  g->dev = dev;
+  g->blockno = blockno;
+  pp = ghostchain(dev, blockno);
+  g->next = *pp;
+  *pp = i;
+}
+
+// Is the key on the ghost list?  If so, forget it.
+static int
+ghostdel(uint dev, uint blockno)
+{
+  struct ghost *g;
+  int *pp;
+
+  for(pp = ghostchain(dev, blockno); *pp >= 0; pp = &g->next){
+    g = &bcache.ghost[*pp];
+    if(g->dev == dev && g->blockno == blockno){
+      *pp = g->next;
+      g->dev = NODEV;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The cached buffer for block blockno on device dev, or 0.
+// Caller must hold bk->lock.
 static struct buf*
-bget(uint dev, uint blockno)
+lookup(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  for(b = bk->head; b != 0; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
       return b;
+  return 0;
+}
+
+// Take b off its hash chain.  Caller must hold the bucket's lock.
+static void
+unhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+    ;
+  *pp = b->hnext;
+}
+
+// Allocate a page worth of new buffers onto QFREE.
+// Returns 0 if the cache is at its limit or memory is short.
+// Caller must hold bcache.lock.
+static int
+bgrow(void)
+{
+  struct buf *b[PGSIZE/BSIZE];
+  char *mem;
+  int i, n;
+
+  if(bcache.nbuf + PGSIZE/BSIZE > bcache.maxbuf || (mem = kalloc()) == 0)
+    return 0;
+  for(n = 0; n < PGSIZE/BSIZE; n++){
+    if((b[n] = kmem_cache_alloc(bcache.cache)) == 0){
+      while(--n >= 0)
+        kmem_cache_free(bcache.cache, b[n]);
+      kfree(mem);
+      return 0;
     }
   }
+  for(i = 0; i < n; i++){
+    memset(b[i], 0, sizeof(*b[i]));
+    initsleeplock(&b[i]->lock, "buffer");
+    b[i]->data = (uchar*)mem + i*BSIZE;
+    qadd(QFREE, b[i]);
+  }
+  bcache.nbuf += n;
+  return 1;
+}
+
+// Evict a buffer from queue q, oldest first, and take it off its
+// hash chain and the queue.  Returns 0 if every buffer on q is busy.
+// Caller must hold bcache.lock and bk->lock.
+static struct buf*
+evict(int q, struct bucket *bk)
+{
+  struct buf *b, *head;
+  struct bucket *old;
+  uint n;
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  head = &bcache.q[q].head;
+  // Two rounds, as the first may only clear used bits.
+  for(n = 2*bcache.q[q].n; n > 0; n--){
+    b = head->prev;
+    old = hash(b->dev, b->blockno);
+    if(old != bk)
+      acquire(&old->lock);
+    qdel(b);
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0 &&
+       (q == QA1 || !b->used)){
+      unhash(old, b);
+      if(old != bk)
+        release(&old->lock);
+      if(q == QA1)
+        ghostadd(b->dev, b->blockno);
       return b;
     }
+    b->used = 0;
+    qadd(q, b);
+    if(old != bk)
+      release(&old->lock);
   }
-  panic("bget: no buffers");
+  return 0;
+}
+
+// Find a buffer to hold a block that hashes to bk: a new one
+// while the cache may still grow, else one evicted from A1 if A1
+// is over its share, else from Am.
+// Caller must hold bcache.lock and bk->lock.
+static struct buf*
+victim(struct bucket *bk)
+{
+  struct buf *b;
+  int q;
+
+  if(bcache.q[QFREE].n > 0 || bgrow()){
+    b = bcache.q[QFREE].head.prev;
+    qdel(b);
+    return b;
+  }
+  q = bcache.q[QA1].n > bcache.nbuf/A1FRAC ? QA1 : QAM;
+  if((b = evict(q, bk)) == 0 && (b = evict(QA1+QAM-q, bk)) == 0)
+    panic("bget: no buffers");
+  return b;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// If ahead is set and the block is cached, return 0 instead.
+static struct buf*
+bget(uint dev, uint blockno, int ahead)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  // Is the block already cached?
+  bk = hash(dev, blockno);
+  acquire(&bk->lock);
+  if((b = lookup(bk, dev, blockno)) != 0){
+    if(ahead){
+      release(&bk->lock);
+      return 0;
+    }
+    b->refcnt++;
+    b->used = 1;
+    bcache.hit[cpuid()]++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  // Not cached; recycle an unused buffer.  Look again first:
+  // another process may have brought the block in meanwhile.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = lookup(bk, dev, blockno)) == 0){
+    b = victim(bk);
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    b->used = 0;
+    b->hnext = bk->head;
+    bk->head = b;
+    qadd(ghostdel(dev, blockno) ? QAM : QA1, b);
+    bcache.miss[cpuid()]++;
+  } else if(ahead){
+    release(&bk->lock);
+    release(&bcache.lock);
+    return 0;
+  } else
+    bcache.hit[cpuid()]++;
+  b->refcnt++;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -98,13 +411,52 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if((b->flags & B_VALID) == 0) {
     iderw(b);
   }
   return b;
 }
 
+// Like bread, but do not wait for the read to finish.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  if((b->flags & B_VALID) == 0)
+    idesubmit(&b, 1);
+  return b;
+}
+
+// Start reading the n indicated blocks into the cache, except
+// those there already, and return without waiting for the disk.
+void
+breadahead(uint dev, uint *blockno, int n)
+{
+  struct buf *b[16];
+  int i, m;
+
+  m = 0;
+  for(i = 0; i < n; i++){
+    if((b[m] = bget(dev, blockno[i], 1)) == 0)
+      continue;
+    if(b[m]->flags & B_VALID){
+      // Someone else read it in before we locked it.
+      brelse(b[m]);
+      continue;
+    }
+    b[m]->flags |= B_ASYNC;
+    if(++m == NELEM(b)){
+      idesubmit(b, m);
+      m = 0;
+    }
+  }
+  if(m > 0)
+    idesubmit(b, m);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,8 +467,54 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Like bwrite, but do not wait for the write to finish.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  b->flags |= B_DIRTY;
+  idesubmit(&b, 1);
+}
+
+// Start I/O on n locked buffers at once.
+void
+bsubmit(struct buf **b, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bsubmit");
+  idesubmit(b, n);
+}
+
+// Wait for I/O started on b by bread_async, bwrite_async
+// or bsubmit to finish.  A dirty buffer with no write
+// submitted would never finish: do not wait on one.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  ideiowait(b);
+}
+
+// Drop a reference to b.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk;
+
+  // While we hold a reference, b keeps its dev and blockno.
+  bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Where it goes in the queues is left to bget().
 void
 brelse(struct buf *b)
 {
@@ -124,21 +522,35 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
+
+// Finish I/O started with B_ASYNC set: release b on behalf of
+// the process that started it.  Called by the disk driver,
+// maybe from its interrupt handler.
+void
+bdone(struct buf *b)
+{
+  b->flags &= ~B_ASYNC;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
+// Fill in the buffer cache part of *ms.
+void
+bstat(struct memstat *ms)
+{
+  int i;
 
   acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  ms->bcache = bcache.nbuf / (PGSIZE/BSIZE);
+  ms->bhot = bcache.q[QAM].n / (PGSIZE/BSIZE);
+  ms->bhit = ms->bmiss = 0;
+  for(i = 0; i < NCPU; i++){
+    ms->bhit += bcache.hit[i];
+    ms->bmiss += bcache.miss[i];
   }
-  
   release(&bcache.lock);
 }
 //PAGEBREAK!
 // Blank page.
-
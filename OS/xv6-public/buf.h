@@ -4,11 +4,15 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  int queue;         // replacement queue, see bio.c
+  int used;          // hit since the clock last passed
+  struct buf *prev; // replacement queue
   struct buf *next;
+  struct buf *hnext; // hash chain
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uchar *data;       // BSIZE bytes
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // no one waits for the I/O: bdone() releases buffer
 
@@ -2,8 +2,12 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct memstat;
+struct pcidev;
 struct pipe;
 struct proc;
+struct procmem;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
@@ -15,6 +19,13 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+struct buf*     bread_async(uint, uint);
+void            bwrite_async(struct buf*);
+void            bsubmit(struct buf**, int);
+void            bwait(struct buf*);
+void            breadahead(uint, uint*, int);
+void            bdone(struct buf*);
+void            bstat(struct memstat*);
 
 // console.c
 void            consoleinit(void);
@@ -59,6 +70,8 @@ int             chmod(int, struct inode*);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf**, int);
+void            ideiowait(struct buf*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -66,19 +79,37 @@ extern uchar    ioapicid;
 void            ioapicinit(void);
 
 // kalloc.c
+extern uint     phystop;
 char*           kalloc(void);
+char*           kalloc_order(int);
 void            kfree(char*);
+void            kfree_order(char*, int);
+char*           kzalloc(void);
+void            kzeroidle(void);
+int             kfreepages(void);
+int             kfreenow(void);
 void            kinit1(void*, void*);
-void            kinit2(void*, void*);
+void            kinit2(void);
+void            kmemstat(struct memstat*);
 
 // kbd.c
 void            kbdintr(void);
 
+// ksm.c
+void            ksminit(void);
+void            ksmmerge(struct proc*, uint, pte_t*);
+void            ksmpass(void);
+int             ksmfault(pde_t*, uint);
+int             ksmdup(uint);
+void            ksmput(uint);
+void            ksmstat(struct memstat*);
+
 // lapic.c
 void            cmostime(struct rtcdate *r);
 int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
+void            lapicipi(int, int);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
@@ -97,11 +128,31 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// mmap.c
+void            mmapinit(void);
+int             mmap(struct file*, uint, uint, int, int);
+int             munmap(uint, uint);
+int             mmapfault(uint, int);
+void            mmapfaultin(uint, uint, int);
+void            mmapexit(void);
+int             mmapfork(struct proc*, struct proc*);
+uint            mmappages(void);
+
+// pci.c
+void            pciinit(void);
+uint            pciread(struct pcidev*, uint);
+void            pciwrite(struct pcidev*, uint, uint);
+struct pcidev*  pcifind(int, int);
+struct pcidev*  pcifindid(int, int);
+void            pcimaster(struct pcidev*);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
+void            pipeinit(void);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
+uint            pipepages(void);
 
 //PAGEBREAK: 16
 // proc.c
@@ -130,7 +181,26 @@ void            release_ptable_lock(void);
 int             thread_create(thread_t*, void*, void*);
 void            thread_exit(void*);
 int             thread_join(thread_t, void**);
+int             thread_stacksize(int);
+char*           swapvictim(uint);
+int             procmem(struct procmem*, int);
+int             quiescent(struct proc*);
+int             pinned(struct proc*, uint);
+void            pinuser(uint, uint);
+void            unpinuser(void);
+void            ksmscan(void);
+void            memstat(struct memstat*);
+
 
+// swap.c
+void            swapinit(void);
+int             swapout(void);
+void            swapreserve(int);
+char*           swapalloc(void);
+int             swapin(pde_t*, uint);
+void            swapinrange(pde_t*, uint, uint);
+void            swapfree(pte_t);
+void            swapstat(struct memstat*);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
@@ -144,6 +214,23 @@ void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// shm.c
+void            shminit(void);
+int             shmget(int, uint);
+int             shmat(int);
+int             shmdt(uint);
+int             shmfork(pde_t*, pde_t*);
+void            shmexit(pde_t*);
+uint            shmpages(void);
+void            shmrelease(int);
+
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+uint            kmem_cache_pages(struct kmem_cache*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -161,7 +248,7 @@ char*           strncpy(char*, const char*, int);
 
 // syscall.c
 int             argint(int, int*);
-int             argptr(int, char**, int);
+int             argptr(int, char**, int, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -181,21 +268,38 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+extern int      virtioirq;
+int             virtioinit(void);
+void            virtiointr(void);
+void            virtiorw(struct buf*);
+void            virtiosubmit(struct buf**, int);
+void            virtioiowait(struct buf*);
+
 // vm.c
 void            seginit(void);
 void            kvmalloc(void);
+pte_t*          walkpgdir(pde_t*, const void*, int);
+int             mappages(pde_t*, void*, uint, uint, int);
 pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
-int             allocuvm(pde_t*, uint, uint);
+int             allocuvm(pde_t*, uint, uint, int);
+int             uvmmap(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, uint*);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
+void            flushtlb(pde_t*, uint, uint);
+void            tlbcheck(void);
+void            switchthd(struct proc*);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t*, char*);
+int             uvmcheck(pde_t*, uint, uint, int);
+void            uvmstat(pde_t*, struct procmem*);
+uint            kvmpgtab(void);
 
 // prac_syscall.c
 int             myfunction(char*);
@@ -53,7 +53,7 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz, 0)) == 0)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
@@ -67,7 +67,7 @@ exec(char *path, char **argv)
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible.  Use the second as the user stack.
   sz = PGROUNDUP(sz);
-  if((sz = allocuvm(pgdir, sz, sz + 2*PGSIZE)) == 0)
+  if((sz = allocuvm(pgdir, sz, sz + 2*PGSIZE, 0)) == 0)
     goto bad;
   clearpteu(pgdir, (char*)(sz - 2*PGSIZE));
   sp = sz;
@@ -98,6 +98,7 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  mmapexit();
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
@@ -109,12 +110,16 @@ exec(char *path, char **argv)
   for(i = 1; i != NTHREAD; i++){
     t = THDADDR(curproc, i);
     if (t->kstack)
-      kfree(t->kstack);
+      kfree_order(t->kstack, KSTACKORDER);
     t->kstack = 0;
     t->state = UNUSED;
     t->tid = 0;
     t->retval = 0;
+    t->ustack = 0;
   }
+  // The thread stacks went with the old page table.
+  MAINTHD(curproc)->ustack = 0;
+  memset(curproc->tstack, 0, sizeof(curproc->tstack));
   MAINTHD(curproc)->tf->eip = elf.entry;
   MAINTHD(curproc)->tf->esp = sp;
   curproc->tid = 0;
@@ -9,6 +9,13 @@ struct file {
 };
 
 
+// Most bytes one transaction may write to a file, for callers
+// that split up large writes.  Each block may log itself and a
+// bitmap block; besides, there are the inode, up to three index
+// blocks (see bmap()) and their bitmap blocks, and 2 blocks of
+// slop for non-aligned writes.
+#define MAXOPWRITE (((MAXOPBLOCKS-1-3-3-2) / 2) * BSIZE)
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
@@ -16,13 +23,16 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ralast;        // last block readi() read
+  uint raend;         // end of the blocks read ahead
+  uint rawin;         // read-ahead window in blocks, 0 if not sequential
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT + 1];
+  uint addrs[NADDRS];
 
   uint permission;
   char owner[16];
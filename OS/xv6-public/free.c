@@ -0,0 +1,41 @@
+// Report the system's memory use.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "memstat.h"
+
+// Print n pages in KB.
+void
+row(char *name, uint n)
+{
+  printf(1, "%s\t%d KB\n", name, n*4);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat ms;
+
+  if(memstat(&ms) < 0){
+    printf(2, "free: memstat failed\n");
+    exit();
+  }
+  row("total", ms.total);
+  row("used", ms.total - ms.free);
+  row("free", ms.free);
+  row("zeroed", ms.zeroed);
+  row("user", ms.user);
+  row("pgtab", ms.pgtab);
+  row("kstack", ms.kstack);
+  row("slab", ms.slab);
+  row("pipe", ms.pipe);
+  row("bcache", ms.bcache);
+  row("bhot", ms.bhot);
+  row("swap", ms.swap);
+  row("swapmax", ms.swaptotal);
+  row("merged", ms.ksm);
+  row("saved", ms.ksmsaved);
+  printf(1, "bhit\t%d\nbmiss\t%d\n", ms.bhit, ms.bmiss);
+  exit();
+}
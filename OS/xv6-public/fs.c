@@ -22,6 +22,9 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define RAMIN 4   // first read-ahead window, in blocks
+#define RAMAX 32  // largest read-ahead window
 static void itrunc(struct inode*);
 // there should be one superblock per disk device, but we run with
 // only one device
@@ -52,46 +55,108 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+#define BRUN 16  // blocks in the free runs that new extents start on
+
+// Return the first block at or after from that starts a run
+// of n free blocks, aligned to n, or -1 if there is none.
+static int
+bfind(uint dev, uint from, int n)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, start;
+  int bi;
 
   bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
+  start = (from + n - 1) / n * n;
+  for(b = start; b < sb.size; b++){
+    if(bp == 0 || b % BPB == 0){
+      if(bp)
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    bi = b % BPB;
+    if(bp->data[bi/8] & (1 << (bi % 8)))
+      start = (b + n) / n * n;
+    else if(b + 1 == start + n){
+      brelse(bp);
+      return start;
     }
+  }
+  if(bp)
     brelse(bp);
+  return -1;
+}
+
+// Choose a free block for balloc(): goal if it is free, else,
+// if n > 1, the start of a free run of n blocks, so that the
+// new block has room to grow into, else the first free block
+// after goal or anywhere.  Returns -1 if the disk is full.
+static int
+bpick(uint dev, uint goal, int n)
+{
+  int b, r;
+
+  if((b = bfind(dev, goal, 1)) == goal)
+    return b;
+  if(n > 1 && ((r = bfind(dev, goal, n)) >= 0 || (r = bfind(dev, 0, n)) >= 0))
+    return r;
+  if(b >= 0)
+    return b;
+  return bfind(dev, 0, 1);
+}
+
+// Allocate a zeroed disk block, as near goal as bpick() can.
+static uint
+balloc(uint dev, uint goal, int n)
+{
+  int b, bi, m;
+  struct buf *bp;
+
+  if(goal >= sb.size)
+    goal = 0;
+  for(;;){
+    if((b = bpick(dev, goal, n)) < 0)
+      panic("balloc: out of blocks");
+    bp = bread(dev, BBLOCK(b, sb));
+    bi = b % BPB;
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0){  // Still free?
+      bp->data[bi/8] |= m;  // Mark block in use.
+      log_write(bp);
+      brelse(bp);
+      bzero(dev, b);
+      return b;
+    }
+    brelse(bp);  // another allocation took it meanwhile
   }
-  panic("balloc: out of blocks");
 }
 
-// Free a disk block.
+// Free the n disk blocks starting at b.
 static void
-bfree(int dev, uint b)
+bfree(int dev, uint b, uint n)
 {
   struct buf *bp;
   int bi, m;
 
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
-  bp->data[bi/8] &= ~m;
-  log_write(bp);
-  brelse(bp);
+  bp = 0;
+  for(; n > 0; b++, n--){
+    if(bp == 0 || b % BPB == 0){
+      if(bp){
+        log_write(bp);
+        brelse(bp);
+      }
+      bp = bread(dev, BBLOCK(b, sb));
+    }
+    bi = b % BPB;
+    m = 1 << (bi % 8);
+    if((bp->data[bi/8] & m) == 0)
+      panic("freeing free block");
+    bp->data[bi/8] &= ~m;
+  }
+  if(bp){
+    log_write(bp);
+    brelse(bp);
+  }
 }
 
 // Inodes.
@@ -180,9 +245,9 @@ iinit(int dev)
 
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
+ inodestart %d bmap start %d swap start %d nswap %d\n", sb.size, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+          sb.bmapstart, sb.swapstart, sb.nswap);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -268,6 +333,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ralast = ip->raend = ip->rawin = 0;
   release(&icache.lock);
 
   return ip;
@@ -367,42 +433,110 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk.  The first blocks are mapped by up
+// to NEXTENT extents in ip->addrs[], each a start block and
+// a length.  The next NINDIRECT blocks are listed in block
+// ip->addrs[INDIRECT], and the rest in the blocks listed in
+// block ip->addrs[DINDIRECT].
+//
+// Files only grow at the end, so a file's blocks are
+// allocated in order: the extents fill up first, and the
+// last extent grows for as long as the disk block after it
+// is free.
+
+// Return entry i of indirect block ind.  If it is empty, fill
+// it with addr, or with a new block if addr is 0.
+static uint
+imap(uint dev, uint ind, uint i, uint addr)
+{
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(dev, ind);
+  a = (uint*)bp->data;
+  if(a[i] == 0){
+    if(addr == 0)
+      addr = balloc(dev, i > 0 ? a[i-1] + 1 : 0, 1);
+    a[i] = addr;
+    log_write(bp);
+  }
+  addr = a[i];
+  brelse(bp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint i, n, end, addr;
+
+  end = 0;
+  for(i = 0; i < NEXTENT && (n = ip->addrs[2*i+1]) != 0; i++){
+    if(bn < n)
+      return ip->addrs[2*i] + bn;
+    bn -= n;
+    end = ip->addrs[2*i] + n;
+  }
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  addr = 0;
+  if(bn == 0 && ip->addrs[INDIRECT] == 0){
+    // A new block right after the extents: extend the last
+    // one if the disk block after it is free, else start
+    // another if there is room.
+    addr = balloc(ip->dev, end, BRUN);
+    if(i > 0 && addr == end){
+      ip->addrs[2*i-1]++;
+      return addr;
+    }
+    if(i < NEXTENT){
+      ip->addrs[2*i] = addr;
+      ip->addrs[2*i+1] = 1;
+      return addr;
+    }
   }
-  bn -= NDIRECT;
 
   if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
-    return addr;
+    if(ip->addrs[INDIRECT] == 0)
+      ip->addrs[INDIRECT] = balloc(ip->dev, 0, 1);
+    return imap(ip->dev, ip->addrs[INDIRECT], bn, addr);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NINDIRECT*NINDIRECT){
+    if(ip->addrs[DINDIRECT] == 0)
+      ip->addrs[DINDIRECT] = balloc(ip->dev, 0, 1);
+    addr = imap(ip->dev, ip->addrs[DINDIRECT], bn / NINDIRECT, 0);
+    return imap(ip->dev, addr, bn % NINDIRECT, 0);
   }
 
   panic("bmap: out of range");
 }
 
+// Free indirect block ind and the blocks it lists, which
+// are indirect blocks themselves if depth > 0.
+static void
+ifree(uint dev, uint ind, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, ind);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 0)
+      ifree(dev, a[j], depth - 1);
+    else
+      bfree(dev, a[j], 1);
+  }
+  brelse(bp);
+  bfree(dev, ind, 1);
+}
+
 // Truncate inode (discard contents).
 // Only called when the inode has no links
 // to it (no directory entries referring to it)
@@ -411,27 +545,23 @@ bmap(struct inode *ip, uint bn)
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
+  for(i = 0; i < NEXTENT; i++){
+    if(ip->addrs[2*i+1]){
+      bfree(ip->dev, ip->addrs[2*i], ip->addrs[2*i+1]);
+      ip->addrs[2*i] = ip->addrs[2*i+1] = 0;
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  if(ip->addrs[INDIRECT]){
+    ifree(ip->dev, ip->addrs[INDIRECT], 0);
+    ip->addrs[INDIRECT] = 0;
+  }
+
+  if(ip->addrs[DINDIRECT]){
+    ifree(ip->dev, ip->addrs[DINDIRECT], 1);
+    ip->addrs[DINDIRECT] = 0;
   }
 
   ip->size = 0;
@@ -453,6 +583,33 @@ stati(struct inode *ip, struct stat *st)
 }
 
 //PAGEBREAK!
+// Read ahead after readi() has read blocks first to last of ip,
+// if they carry on where the previous read left off.  The window
+// starts at RAMIN blocks and doubles on each further sequential
+// read, up to RAMAX.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, n, blocks[RAMAX];
+
+  if(first != ip->ralast && first != ip->ralast + 1){
+    ip->rawin = ip->raend = 0;
+    ip->ralast = last;
+    return;
+  }
+  if(last == ip->ralast)
+    return;
+  ip->ralast = last;
+  ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  end = min(last + 1 + ip->rawin, (ip->size + BSIZE-1) / BSIZE);
+  n = 0;
+  for(bn = max(ip->raend, last + 1); bn < end; bn++)
+    blocks[n++] = bmap(ip, bn);
+  breadahead(ip->dev, blocks, n);
+  if(end > ip->raend)
+    ip->raend = end;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 int
@@ -478,6 +635,8 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
+  if(n > 0)
+    readahead(ip, (off - n) / BSIZE, (off - 1) / BSIZE);
   return n;
 }
 
@@ -498,7 +657,7 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(n > 0 && (off + n - 1) / BSIZE >= MAXFILE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
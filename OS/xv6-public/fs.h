@@ -3,7 +3,7 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#define BSIZE 4096  // block size
 
 #define MODE_RUSR 32 // owner read
 #define MODE_WUSR 16 // owner write
@@ -18,7 +18,7 @@
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//                                          free bit map | data blocks]
+//                                          free bit map | data blocks | swap ]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -30,11 +30,21 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint swapstart;    // Block number of first swap block
+  uint nswap;        // Number of swap blocks
 };
 
-#define NDIRECT 7
+// A file's first blocks are mapped by up to NEXTENT extents, runs
+// of consecutive disk blocks, kept as (start, length) pairs in
+// addrs[].  Blocks past the extents are listed in the indirect
+// block addrs[INDIRECT], then through the double-indirect block
+// addrs[DINDIRECT].
+#define NEXTENT 3
+#define INDIRECT (2*NEXTENT)
+#define DINDIRECT (INDIRECT + 1)
+#define NADDRS (DINDIRECT + 1)
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NINDIRECT + NINDIRECT*NINDIRECT)  // with no extents
 
 // On-disk inode structure
 struct dinode {
@@ -43,7 +53,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NADDRS];   // Data block addresses
   uint permission;
   char owner[16];
 };
@@ -1,4 +1,19 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// IDE driver code, using bus-master DMA when the PCI IDE
+// controller offers it and PIO otherwise.
+//
+// Requests wait on idequeue, sorted by block number, and the disk
+// serves them in C-SCAN order: next comes the first request at or
+// after the block where the last command ended, or the lowest one
+// if there is none.  The requests for the blocks that follow it
+// are merged into the same multi-sector command, up to IDE_MAXSECT
+// sectors.
+//
+// With DMA the controller moves a whole command's data by itself,
+// following a table of physical regions (the PRD table) that has
+// an entry for each buf, and interrupts once at the end.
+//
+// If there is a virtio block device, it takes the place of disk 1
+// and the functions at the bottom pass its requests to virtio.c.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +27,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,16 +39,60 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+#define IDE_CMD_READ_EXT  0x24  // the same, with 48-bit sector numbers
+#define IDE_CMD_WRITE_EXT 0x34
+#define IDE_CMD_RDMUL_EXT 0x29
+#define IDE_CMD_WRMUL_EXT 0x39
+#define IDE_CMD_RDDMA_EXT 0x25
+#define IDE_CMD_WRDMA_EXT 0x35
+#define IDE_CMD_IDENTIFY  0xec
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// Bus-master registers, at idebm.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_START      0x01  // in BM_CMD
+#define BM_READ       0x08  //   controller writes memory
+#define BM_ERR        0x02  // in BM_STATUS
+#define BM_INTR       0x04
+
+// An entry of the PRD table: one physically contiguous region
+// that may not cross a 64KB boundary.
+struct prd {
+  uint addr;
+  ushort len;    // 0 means 64KB
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last entry
+
+#define IDE_MULT      16   // sectors per interrupt for RDMUL/WRMUL
+#define IDE_MAXSECT   128  // most sectors per command
+
+// idequeue holds the bufs waiting for the disk, through qnext.
+// ideactive is the run of bufs for consecutive blocks that the
+// disk is working on; idecur, idecuroff and ideleft track how far
+// the transfer has got.
+// You must hold idelock while manipulating any of them.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static struct buf *ideactive;
+static struct buf *idecur;
+static uint idecuroff;     // offset in idecur->data
+static int ideleft;        // sectors still to transfer
+static uint idenext;       // block after the last run started
 
 static int havedisk1;
-static void idestart(struct buf*);
+static int havevirtio;     // disk 1 is the virtio disk
+static int idemult[2];     // sectors per interrupt, for each disk, for PIO
+static uint idesize[2];    // sectors on each disk
+static int idelba48[2];    // does the disk take 48-bit sector numbers?
+static ushort idebm;       // bus-master registers, 0 if no DMA
+static struct prd *ideprd; // PRD table, a page
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,6 +107,52 @@ idewait(int checkerr)
   return 0;
 }
 
+// Learn disk's size, and whether it can address sectors past
+// 2^28 (128GB), from its IDENTIFY data.
+static void
+ideidentify(int disk)
+{
+  static ushort id[256];
+
+  outb(0x1f6, 0xe0 | (disk<<4));
+  idewait(0);
+  outb(0x1f7, IDE_CMD_IDENTIFY);
+  if(idewait(1) < 0)
+    panic("ide: identify");
+  insl(0x1f0, id, sizeof(id)/4);
+  idelba48[disk] = (id[83] & (1<<10)) != 0;
+  if(idelba48[disk])
+    idesize[disk] = (id[102] || id[103]) ? 0xFFFFFFFF : id[100] | id[101]<<16;
+  else
+    idesize[disk] = id[60] | id[61]<<16;
+}
+
+// Ask disk to move IDE_MULT sectors per interrupt,
+// or note that it moves one if it will not.
+static void
+idesetmult(int disk)
+{
+  outb(0x1f6, 0xe0 | (disk<<4));
+  idewait(0);
+  outb(0x1f2, IDE_MULT);
+  outb(0x1f7, IDE_CMD_SETMUL);
+  idemult[disk] = idewait(1) < 0 ? 1 : IDE_MULT;
+}
+
+// Use bus-master DMA if there is a PCI IDE controller
+// that can do it.
+static void
+idedmainit(void)
+{
+  struct pcidev *d;
+
+  if((d = pcifind(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE)) == 0 ||
+     (d->bar[4] & 1) == 0 || (ideprd = (struct prd*)kalloc()) == 0)
+    return;
+  pcimaster(d);
+  idebm = d->bar[4] & ~3;
+}
+
 void
 ideinit(void)
 {
@@ -65,77 +171,210 @@ ideinit(void)
     }
   }
 
-  // Switch back to disk 0.
-  outb(0x1f6, 0xe0 | (0<<4));
+  if(havedisk1){
+    ideidentify(1);
+    idesetmult(1);
+  }
+  ideidentify(0);
+  idesetmult(0);  // leaves disk 0 selected
+  idedmainit();
+  havevirtio = virtioinit();
+}
+
+// Fill the PRD table for the run of bufs starting at b and load
+// it into the controller.  Caller must hold idelock.
+static void
+ideprdfill(struct buf *b, int write)
+{
+  uint pa, end, n;
+  int i;
+
+  i = 0;
+  for(; b != 0; b = b->qnext){
+    for(pa = V2P(b->data), end = pa + BSIZE; pa < end; pa += n, i++){
+      n = ((pa + 0x10000) & ~0xffff) - pa;
+      if(n > end - pa)
+        n = end - pa;
+      ideprd[i].addr = pa;
+      ideprd[i].len = n;
+      ideprd[i].flags = 0;
+    }
+  }
+  ideprd[i-1].flags = PRD_EOT;
+  outl(idebm + BM_PRDT, V2P(ideprd));
+  outb(idebm + BM_CMD, write ? 0 : BM_READ);
+  outb(idebm + BM_STATUS, inb(idebm + BM_STATUS) | BM_INTR | BM_ERR);
+}
+
+// Move the next DRQ block of the active run, up to idemult
+// sectors, between the disk and the bufs.
+// Caller must hold idelock.
+static void
+idepio(int write)
+{
+  int n;
+
+  n = idemult[ideactive->dev&1];
+  if(n > ideleft)
+    n = ideleft;
+  for(; n > 0; n--){
+    if(write)
+      outsl(0x1f0, idecur->data + idecuroff, SECTOR_SIZE/4);
+    else
+      insl(0x1f0, idecur->data + idecuroff, SECTOR_SIZE/4);
+    ideleft--;
+    if((idecuroff += SECTOR_SIZE) == BSIZE){
+      idecur = idecur->qnext;
+      idecuroff = 0;
+    }
+  }
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Take the next run of requests off idequeue and start it.
+// Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idestart(void)
 {
-  if(b == 0)
-    panic("idestart");
-  if(b->blockno >= FSSIZE)
+  struct buf **pp, *b, *last;
+  int n, d, write, ext;
+  uint sector;
+
+  if(idequeue == 0)
+    return;
+  for(pp = &idequeue; *pp != 0; pp = &(*pp)->qnext)
+    if((*pp)->blockno >= idenext)
+      break;
+  if(*pp == 0)
+    pp = &idequeue;  // wrap around
+  b = last = *pp;
+  write = b->flags & B_DIRTY;
+  n = BSIZE/SECTOR_SIZE;
+  while(last->qnext != 0 && last->qnext->dev == b->dev &&
+        last->qnext->blockno == last->blockno + 1 &&
+        (last->qnext->flags & B_DIRTY) == write &&
+        n + BSIZE/SECTOR_SIZE <= IDE_MAXSECT){
+    last = last->qnext;
+    n += BSIZE/SECTOR_SIZE;
+  }
+  *pp = last->qnext;
+  last->qnext = 0;
+  d = b->dev & 1;
+  sector = b->blockno * (BSIZE/SECTOR_SIZE);
+  if(last->blockno >= idesize[d] / (BSIZE/SECTOR_SIZE))
     panic("incorrect blockno");
-  int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  // LBA28 reaches only the first 2^28 sectors.
+  ext = sector + n > (1<<28);
+
+  ideactive = idecur = b;
+  idecuroff = 0;
+  ideleft = n;
+  idenext = last->blockno + 1;
 
-  if (sector_per_block > 7) panic("idestart");
+  if(idebm)
+    ideprdfill(b, write);
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  if(ext){
+    // The high bytes go first through the same registers.
+    outb(0x1f2, 0);
+    outb(0x1f3, (sector >> 24) & 0xff);
+    outb(0x1f4, 0);
+    outb(0x1f5, 0);
+  }
+  outb(0x1f2, n);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
-    outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+  if(ext)
+    outb(0x1f6, 0x40 | (d<<4));
+  else
+    outb(0x1f6, 0xe0 | (d<<4) | ((sector>>24)&0x0f));
+  if(idebm){
+    if(ext)
+      outb(0x1f7, write ? IDE_CMD_WRDMA_EXT : IDE_CMD_RDDMA_EXT);
+    else
+      outb(0x1f7, write ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(idebm + BM_CMD, (write ? 0 : BM_READ) | BM_START);
+  } else if(idemult[d] > 1){
+    if(ext)
+      outb(0x1f7, write ? IDE_CMD_WRMUL_EXT : IDE_CMD_RDMUL_EXT);
+    else
+      outb(0x1f7, write ? IDE_CMD_WRMUL : IDE_CMD_RDMUL);
   } else {
-    outb(0x1f7, read_cmd);
+    if(ext)
+      outb(0x1f7, write ? IDE_CMD_WRITE_EXT : IDE_CMD_READ_EXT);
+    else
+      outb(0x1f7, write ? IDE_CMD_WRITE : IDE_CMD_READ);
   }
+  if(write && !idebm)
+    idepio(1);
 }
 
 // Interrupt handler.
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next;
+  int st;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if((b = ideactive) == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idebm){
+    // The controller has moved the whole run, unless this
+    // interrupt is not its own.
+    st = inb(idebm + BM_STATUS);
+    if((st & BM_INTR) == 0){
+      release(&idelock);
+      return;
+    }
+    outb(idebm + BM_CMD, 0);
+    outb(idebm + BM_STATUS, st | BM_INTR | BM_ERR);
+    idewait(1);
+    ideleft = 0;
+  } else if(idewait(1) < 0)
+    ideleft = 0;  // give up on the run
+  else if(!(b->flags & B_DIRTY))
+    idepio(0);    // each PIO interrupt of a read brings data
+  else if(ideleft > 0){
+    idepio(1);    // each but the last of a write asks for more
+    release(&idelock);
+    return;
+  }
+  if(ideleft > 0){
+    // More sectors to read.
+    release(&idelock);
+    return;
+  }
+  ideactive = 0;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  // Wake processes waiting for these bufs.
+  for(; b != 0; b = next){
+    next = b->qnext;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC)
+      bdone(b);
+    else
+      wakeup(b);
+  }
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  // Start disk on next run in queue.
+  idestart();
 
   release(&idelock);
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
-void
-iderw(struct buf *b)
+// Add b to idequeue, keeping it sorted by block number.
+// Caller must hold idelock.
+static void
+ideappend(struct buf *b)
 {
   struct buf **pp;
 
@@ -146,17 +385,30 @@ iderw(struct buf *b)
   if(b->dev != 0 && !havedisk1)
     panic("iderw: ide disk 1 not present");
 
-  acquire(&idelock);  //DOC:acquire-lock
-
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+  for(pp=&idequeue; *pp && (*pp)->blockno <= b->blockno; pp=&(*pp)->qnext)  //DOC:insert-queue
     ;
+  b->qnext = *pp;
   *pp = b;
+}
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  if(b->dev == 1 && havevirtio){
+    virtiorw(b);
+    return;
+  }
+
+  acquire(&idelock);  //DOC:acquire-lock
+
+  ideappend(b);
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(ideactive == 0)
+    idestart();
 
   // Wait for request to finish.
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
@@ -166,3 +418,40 @@ iderw(struct buf *b)
 
   release(&idelock);
 }
+
+// Queue requests for n bufs, all for the same disk, and return
+// without waiting.  Queueing them together lets idestart() merge
+// them.  A buf with B_ASYNC set is handed to bdone() when done;
+// wait for any other with ideiowait().
+void
+idesubmit(struct buf **b, int n)
+{
+  int i;
+
+  if(n > 0 && b[0]->dev == 1 && havevirtio){
+    virtiosubmit(b, n);
+    return;
+  }
+
+  acquire(&idelock);
+  for(i = 0; i < n; i++)
+    ideappend(b[i]);
+  if(ideactive == 0)
+    idestart();
+  release(&idelock);
+}
+
+// Wait for the request for b queued by idesubmit() to finish.
+void
+ideiowait(struct buf *b)
+{
+  if(b->dev == 1 && havevirtio){
+    virtioiowait(b);
+    return;
+  }
+
+  acquire(&idelock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &idelock);
+  release(&idelock);
+}
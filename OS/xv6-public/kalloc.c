@@ -1,6 +1,16 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
-// and pipe buffers. Allocates 4096-byte pages.
+// and pipe buffers. Allocates blocks of 2^order contiguous
+// 4096-byte pages using a binary buddy system.
+//
+// Besides the buddy lists, a small pool of pages that are
+// already zero is kept for kzalloc(); the scheduler refills it
+// with kzeroidle() when it has nothing to run.
+//
+// The amount of memory comes from the BIOS memory map that
+// bootasm.S leaves at E820MAP.  Memory above the first 4MB is not
+// put on the free lists at boot: kgrow() hands it over one
+// 4MB block at a time when the lists run dry.
 
 #include "types.h"
 #include "defs.h"
@@ -8,89 +18,364 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "spinlock.h"
+#include "memstat.h"
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
 
+#define NRANGE 8  // most usable ranges of the BIOS memory map kept
+
+uint phystop;  // end of physical memory
+
+// An entry of the BIOS memory map.
+struct e820 {
+  uint addr, addrhi;
+  uint len, lenhi;
+  uint type;     // 1 for usable RAM
+};
+
+// A free block.  The free lists are circular and doubly linked
+// so that a buddy can be unlinked from the middle of its list
+// when it is coalesced.
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run freelist[MAXORDER+1];  // list heads, one per order
+  // For each physical page, order+1 if a free block of that
+  // order starts at the page, 0 otherwise.  Sized by phystop.
+  uchar *order;
+  struct run *zeroed;  // pool of zero pages, linked through first word
+  int nzeroed;
+  int nfree;           // free pages, including the zero pool
+  struct {
+    uint start, end;
+  } range[NRANGE];     // memory not yet given to the free lists
+  int nrange;
+  int nlazy;           // pages in range[]
+  int ntotal;          // pages managed, free or not
 } kmem;
 
+#define PGNUM(v) (V2P(v) / PGSIZE)
+
+static void
+buddy_push(struct run *r, int order)
+{
+  struct run *head = &kmem.freelist[order];
+
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+  kmem.order[PGNUM(r)] = order + 1;
+  kmem.nfree += 1 << order;
+}
+
+static void
+buddy_unlink(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.nfree -= 1 << (kmem.order[PGNUM(r)] - 1);
+  kmem.order[PGNUM(r)] = 0;
+}
+
+// Read the BIOS memory map: set phystop and note the usable
+// memory at or above low in kmem.range[].
+static void
+e820scan(uint low)
+{
+  struct e820 *e;
+  uint n, start, end;
+
+  n = *(uint*)P2V(E820MAP);
+  e = (struct e820*)P2V(E820MAP + 4);
+  for(; n > 0; n--, e++){
+    if(e->type != 1 || e->addrhi != 0)
+      continue;
+    start = PGROUNDUP(e->addr);
+    end = e->addr + e->len;
+    if(e->lenhi != 0 || end < e->addr || end > PHYSTOP)
+      end = PHYSTOP;
+    end = PGROUNDDOWN(end);
+    if(end > phystop)
+      phystop = end;
+    if(start < low)
+      start = low;
+    if(start >= end || kmem.nrange == NRANGE)
+      continue;
+    kmem.range[kmem.nrange].start = start;
+    kmem.range[kmem.nrange].end = end;
+    kmem.nrange++;
+  }
+  if(phystop == 0){
+    // No map: assume the old fixed amount.
+    phystop = DEFPHYSTOP;
+    kmem.range[0].start = low;
+    kmem.range[0].end = DEFPHYSTOP;
+    kmem.nrange = 1;
+  }
+}
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
-// the pages mapped by entrypgdir on free list.
-// 2. main() calls kinit2() with the rest of the physical pages
-// after installing a full page table that maps them on all cores.
+// the pages mapped by entrypgdir on free list.  The per-page
+// order table is carved out of the start of those pages.
+// 2. main() calls kinit2() after installing a full page table that
+// maps all of memory on all cores; from then on kgrow() may hand
+// the rest of memory to the free lists.
 void
 kinit1(void *vstart, void *vend)
 {
+  int i, n;
+
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
-  freerange(vstart, vend);
+  for(i = 0; i <= MAXORDER; i++)
+    kmem.freelist[i].next = kmem.freelist[i].prev = &kmem.freelist[i];
+  e820scan(V2P(vend));
+  for(i = 0; i < kmem.nrange; i++)
+    kmem.nlazy += (kmem.range[i].end - kmem.range[i].start) / PGSIZE;
+
+  n = phystop / PGSIZE;
+  kmem.order = (uchar*)PGROUNDUP((uint)vstart);
+  memset(kmem.order, 0, n);
+  freerange(kmem.order + n, vend);
+  kmem.ntotal = kmem.nfree + kmem.nlazy;
 }
 
 void
-kinit2(void *vstart, void *vend)
+kinit2(void)
 {
-  freerange(vstart, vend);
   kmem.use_lock = 1;
 }
 
+// Move up to one 4MB block of not yet used memory onto the free
+// lists.  Returns 0 if there is none left.
+// Caller must hold kmem.lock.
+static int
+kgrow(void)
+{
+  uint start, end, max;
+  int i;
+
+  for(i = 0; i < kmem.nrange; i++)
+    if(kmem.range[i].start < kmem.range[i].end)
+      break;
+  if(i == kmem.nrange)
+    return 0;
+  max = PGSIZE << MAXORDER;
+  start = kmem.range[i].start;
+  end = (start + max) & ~(max - 1);
+  if(end > kmem.range[i].end || end < start)
+    end = kmem.range[i].end;
+  kmem.range[i].start = end;
+  kmem.nlazy -= (end - start) / PGSIZE;
+  freerange(P2V(start), P2V(end));
+  return 1;
+}
+
+static void buddy_free(struct run*, int);
+
+// Seed the allocator with [vstart, vend), handing it over
+// in the largest naturally aligned blocks that fit.
+// Caller must hold kmem.lock once it is in use.
 void
 freerange(void *vstart, void *vend)
 {
   char *p;
+  int order;
+
   p = (char*)PGROUNDUP((uint)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
-    kfree(p);
+  while(p + PGSIZE <= (char*)vend){
+    for(order = MAXORDER; order > 0; order--)
+      if(V2P(p) % (PGSIZE << order) == 0 &&
+         p + (PGSIZE << order) <= (char*)vend)
+        break;
+    buddy_free((struct run*)p, order);
+    p += PGSIZE << order;
+  }
 }
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
+// Free the block of 2^order pages pointed at by v, which
+// normally should have been returned by a call to
+// kalloc_order(order).  (The exception is when
 // initializing the allocator; see kinit above.)
+// The block is merged with its buddy for as long as
+// the buddy is free as well.
 void
-kfree(char *v)
+kfree_order(char *v, int order)
 {
-  struct run *r;
+  uint size;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+  size = PGSIZE << order;
+  if(order < 0 || order > MAXORDER || (uint)v % size || v < end ||
+     V2P(v) + size > phystop)
     panic("kfree");
 
+#ifdef MEMDEBUG
   // Fill with junk to catch dangling refs.
-  memset(v, 1, PGSIZE);
+  memset(v, 1, size);
+#endif
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
+  buddy_free((struct run*)v, order);
   if(kmem.use_lock)
     release(&kmem.lock);
 }
 
+// Put block r of 2^order pages on the free lists, merged with
+// its free buddies.  Caller must hold kmem.lock once it is in use.
+static void
+buddy_free(struct run *r, int order)
+{
+  struct run *buddy;
+
+  if(kmem.order[PGNUM(r)])
+    panic("kfree: double free");
+  for(; order < MAXORDER; order++){
+    buddy = (struct run*)P2V(V2P(r) ^ (PGSIZE << order));
+    if(V2P(buddy) >= phystop || kmem.order[PGNUM(buddy)] != order + 1)
+      break;
+    buddy_unlink(buddy);
+    if(buddy < r)
+      r = buddy;
+  }
+  buddy_push(r, order);
+}
+
+// Free the page of physical memory pointed at by v.
+void
+kfree(char *v)
+{
+  kfree_order(v, 0);
+}
+
+// Allocate 2^order physically contiguous 4096-byte pages,
+// aligned to their size.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_order(int order)
+{
+  struct run *r;
+  int k;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  r = 0;
+  do {
+    for(k = order; k <= MAXORDER; k++){
+      if(kmem.freelist[k].next != &kmem.freelist[k]){
+        r = kmem.freelist[k].next;
+        buddy_unlink(r);
+        break;
+      }
+    }
+  } while(r == 0 && kmem.use_lock && kgrow());
+  // Split the block, returning the upper halves to the free lists.
+  for(; r && k > order; k--)
+    buddy_push((struct run*)((char*)r + (PGSIZE << (k-1))), k-1);
+  // Out of free blocks: fall back on the zero pool.
+  if(r == 0 && order == 0 && (r = kmem.zeroed) != 0){
+    kmem.zeroed = r->next;
+    kmem.nzeroed--;
+    kmem.nfree--;
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return (char*)r;
+}
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 char*
 kalloc(void)
+{
+  return kalloc_order(0);
+}
+
+// Allocate one 4096-byte page of physical memory filled with zeros.
+// Takes a page from the zero pool when there is one, so the
+// caller does not pay for clearing it.
+// Returns 0 if the memory cannot be allocated.
+char*
+kzalloc(void)
 {
   struct run *r;
 
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  if((r = kmem.zeroed) != 0){
+    kmem.zeroed = r->next;
+    kmem.nzeroed--;
+    kmem.nfree--;
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
+  if(r){
+    r->next = 0;
+    return (char*)r;
+  }
+  if((r = (struct run*)kalloc()) != 0)
+    memset(r, 0, PGSIZE);
   return (char*)r;
 }
 
+// Called by the scheduler when it finds nothing to run.
+// Zeroes one free page and adds it to the zero pool,
+// unless the pool already holds NZEROPAGE pages.
+void
+kzeroidle(void)
+{
+  struct run *r;
+
+  if(kmem.nzeroed >= NZEROPAGE)
+    return;
+  if((r = (struct run*)kalloc()) == 0)
+    return;
+  memset(r, 0, PGSIZE);
+  acquire(&kmem.lock);
+  r->next = kmem.zeroed;
+  kmem.zeroed = r;
+  kmem.nzeroed++;
+  kmem.nfree++;
+  release(&kmem.lock);
+}
+
+// Fill in the allocator's part of *ms.
+void
+kmemstat(struct memstat *ms)
+{
+  acquire(&kmem.lock);
+  ms->total = kmem.ntotal;
+  ms->free = kmem.nfree + kmem.nlazy;
+  ms->zeroed = kmem.nzeroed;
+  release(&kmem.lock);
+}
+
+// Number of free pages, counting memory kgrow() has yet to
+// hand over.  Only a hint: it may change as soon as it is returned.
+int
+kfreepages(void)
+{
+  return kmem.nfree + kmem.nlazy;
+}
+
+// Number of pages on the free lists.  Before kinit2() this is
+// all that can be allocated.
+int
+kfreenow(void)
+{
+  return kmem.nfree;
+}
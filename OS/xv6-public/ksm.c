@@ -0,0 +1,297 @@
+// Same-page merging.
+//
+// The heap pages of processes that ask for it with ksm(1) are
+// looked at a few at a time by ksmscan() in proc.c while a CPU is
+// idle.  Pages with equal contents are merged into one read-only
+// page whose PTEs carry PTE_KSM; a write to it faults, and
+// ksmfault() gives the writer a private copy again.
+//
+// Merged pages are kept in ksm.page[] with the number of PTEs that
+// map each, hashed both by physical address and by checksum.  To
+// find the first pair, a page that matches no merged
+// page is remembered by checksum in ksm.hint[], a direct-mapped
+// table that is emptied after every pass of the scanner, and
+// compared against the next page with the same checksum.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "memstat.h"
+
+#define NKSMHINT 256
+
+struct kpage {
+  uint pa;       // 0 if slot is free
+  uint sum;      // checksum of contents
+  int ref;       // number of PTEs mapping it
+  struct kpage *panext;   // hash chain by pa, or free list
+  struct kpage *sumnext;  // hash chain by sum
+};
+
+#define PAHASH(pa)   (((pa) / PGSIZE) % NKSM)
+#define SUMHASH(sum) ((sum) % NKSM)
+
+// A page seen by the scanner: page va of process p.
+struct khint {
+  struct proc *p;  // 0 if slot is free
+  int pid;         // to notice that p has exited
+  uint va;
+  uint sum;
+};
+
+struct {
+  struct spinlock lock;
+  struct kpage page[NKSM];
+  struct kpage *pahash[NKSM];
+  struct kpage *sumhash[NKSM];
+  struct kpage *free;
+  struct khint hint[NKSMHINT];
+} ksm;
+
+void
+ksminit(void)
+{
+  struct kpage *k;
+
+  initlock(&ksm.lock, "ksm");
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++){
+    k->panext = ksm.free;
+    ksm.free = k;
+  }
+}
+
+static uint
+checksum(uint *w)
+{
+  uint sum;
+  int i;
+
+  sum = 0;
+  for(i = 0; i < PGSIZE/sizeof(uint); i++)
+    sum = sum*31 + w[i];
+  return sum;
+}
+
+// Find the merged page at physical address pa, or 0.
+// Caller must hold ksm.lock.
+static struct kpage*
+findpage(uint pa)
+{
+  struct kpage *k;
+
+  for(k = ksm.pahash[PAHASH(pa)]; k; k = k->panext)
+    if(k->pa == pa)
+      return k;
+  return 0;
+}
+
+// Record page pa, of checksum sum, as merged, or return 0 if
+// ksm.page[] is full.  Caller must hold ksm.lock.
+static struct kpage*
+newpage(uint pa, uint sum)
+{
+  struct kpage *k;
+
+  if((k = ksm.free) == 0)
+    return 0;
+  ksm.free = k->panext;
+  k->pa = pa;
+  k->sum = sum;
+  k->ref = 0;
+  k->panext = ksm.pahash[PAHASH(pa)];
+  ksm.pahash[PAHASH(pa)] = k;
+  k->sumnext = ksm.sumhash[SUMHASH(sum)];
+  ksm.sumhash[SUMHASH(sum)] = k;
+  return k;
+}
+
+// Forget merged page k.  Caller must hold ksm.lock.
+static void
+droppage(struct kpage *k)
+{
+  struct kpage **kp;
+
+  for(kp = &ksm.pahash[PAHASH(k->pa)]; *kp != k; kp = &(*kp)->panext)
+    ;
+  *kp = k->panext;
+  for(kp = &ksm.sumhash[SUMHASH(k->sum)]; *kp != k; kp = &(*kp)->sumnext)
+    ;
+  *kp = k->sumnext;
+  k->pa = 0;
+  k->panext = ksm.free;
+  ksm.free = k;
+}
+
+// The PTE of the page h remembers, if it is still there and may
+// be merged.  Caller must hold ptable.lock and ksm.lock.
+static pte_t*
+hintpte(struct khint *h)
+{
+  pte_t *pte;
+
+  if(h->p->pid != h->pid || !h->p->ksm || h->va >= h->p->sz ||
+     !quiescent(h->p) || pinned(h->p, h->va))
+    return 0;
+  pte = walkpgdir(h->p->pgdir, (char*)h->va, 0);
+  if(pte == 0 || (*pte & (PTE_P|PTE_U|PTE_W|PTE_PS|PTE_SHM|PTE_KSM)) !=
+     (PTE_P|PTE_U|PTE_W))
+    return 0;
+  return pte;
+}
+
+// Try to merge page va of process p, mapped by *pte, with a page
+// of the same contents.  p must be quiescent.
+// Caller must hold ptable.lock.
+void
+ksmmerge(struct proc *p, uint va, pte_t *pte)
+{
+  struct kpage *k;
+  struct khint *h;
+  pte_t *hpte;
+  char *mem;
+  uint sum;
+
+  mem = P2V(PTE_ADDR(*pte));
+  sum = checksum((uint*)mem);
+
+  acquire(&ksm.lock);
+  for(k = ksm.sumhash[SUMHASH(sum)]; k; k = k->sumnext){
+    if(k->sum == sum && memcmp(P2V(k->pa), mem, PGSIZE) == 0){
+      k->ref++;
+      goto merged;
+    }
+  }
+
+  h = &ksm.hint[sum % NKSMHINT];
+  if(ksm.free && h->p && h->sum == sum && (h->p != p || h->va != va) &&
+     (hpte = hintpte(h)) != 0 &&
+     memcmp(P2V(PTE_ADDR(*hpte)), mem, PGSIZE) == 0){
+    k = newpage(PTE_ADDR(*hpte), sum);
+    k->ref = 2;
+    *hpte = k->pa | PTE_P | PTE_U | PTE_KSM;
+    h->p = 0;
+    goto merged;
+  }
+  h->p = p;
+  h->pid = p->pid;
+  h->va = va;
+  h->sum = sum;
+  release(&ksm.lock);
+  return;
+
+merged:
+  // p is not running anywhere, so no TLB holds the old PTE.
+  *pte = k->pa | PTE_P | PTE_U | PTE_KSM;
+  release(&ksm.lock);
+  kfree(mem);
+}
+
+// End of a scanner pass: forget the pages seen, which may well
+// have changed by the next pass.
+void
+ksmpass(void)
+{
+  acquire(&ksm.lock);
+  memset(ksm.hint, 0, sizeof(ksm.hint));
+  release(&ksm.lock);
+}
+
+// Handle a write fault at va: if it hit a merged page, give
+// the process its own writable copy.  Returns 0 if the write
+// can be retried, -1 if va is not a merged page or there is no
+// memory for the copy.
+int
+ksmfault(pde_t *pgdir, uint va)
+{
+  struct kpage *k;
+  pte_t *pte;
+  char *mem;
+  uint pa;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (char*)va, 0)) == 0 ||
+     !(*pte & PTE_KSM))
+    return -1;
+  mem = swapalloc();
+
+  acquire(&ksm.lock);
+  if(*pte & PTE_KSM){
+    pa = PTE_ADDR(*pte);
+    if((k = findpage(pa)) == 0){
+      // A sibling thread is unmapping it.
+      release(&ksm.lock);
+      if(mem)
+        kfree(mem);
+      return -1;
+    }
+    if(k->ref == 1){
+      // The last mapping: simply take the page back.
+      droppage(k);
+    } else if(mem){
+      memmove(mem, P2V(pa), PGSIZE);
+      k->ref--;
+      pa = V2P(mem);
+      mem = 0;
+    } else {
+      release(&ksm.lock);
+      return -1;
+    }
+    *pte = pa | PTE_P | PTE_U | PTE_W;
+  }
+  release(&ksm.lock);
+  if(mem)
+    kfree(mem);  // not needed after all
+  flushtlb(pgdir, PGROUNDDOWN(va), PGSIZE);
+  return 0;
+}
+
+// Another PTE is to map merged page pa.  Called by copyuvm() for
+// fork().  Returns -1 if a sibling thread has just unmerged it.
+int
+ksmdup(uint pa)
+{
+  struct kpage *k;
+
+  acquire(&ksm.lock);
+  if((k = findpage(pa)) != 0)
+    k->ref++;
+  release(&ksm.lock);
+  return k ? 0 : -1;
+}
+
+// A PTE mapping merged page pa went away; the last one frees it.
+void
+ksmput(uint pa)
+{
+  struct kpage *k;
+  int last;
+
+  acquire(&ksm.lock);
+  if((k = findpage(pa)) == 0)
+    panic("ksmput");
+  if((last = (--k->ref == 0)))
+    droppage(k);
+  release(&ksm.lock);
+  if(last)
+    kfree(P2V(pa));
+}
+
+// Fill in the merging part of *ms.
+void
+ksmstat(struct memstat *ms)
+{
+  struct kpage *k;
+
+  ms->ksm = ms->ksmsaved = 0;
+  acquire(&ksm.lock);
+  for(k = ksm.page; k < &ksm.page[NKSM]; k++){
+    if(k->pa){
+      ms->ksm++;
+      ms->ksmsaved += k->ref - 1;
+    }
+  }
+  release(&ksm.lock);
+}
@@ -65,19 +65,29 @@ initlog(int dev)
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// All the log reads are started at once, then all the writes.
+// The home blocks are read with bread(): during a commit they
+// are cached and dirty, so there is no read to wait for.
 static void
 install_trans(void)
 {
+  struct buf *lbuf[LOGSIZE], *dbuf[LOGSIZE];
   int tail;
 
+  for (tail = 0; tail < log.lh.n; tail++)
+    lbuf[tail] = bread_async(log.dev, log.start+tail+1); // read log block
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+    bwait(lbuf[tail]);
+    dbuf[tail] = bread(log.dev, log.lh.block[tail]); // read dst
+    memmove(dbuf[tail]->data, lbuf[tail]->data, BSIZE);  // copy block to dst
+    dbuf[tail]->flags |= B_DIRTY;
+    brelse(lbuf[tail]);
+  }
+  bsubmit(dbuf, log.lh.n);  // write dst to disk
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(dbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
@@ -173,19 +183,27 @@ end_op(void)
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log, and write them
+// out all at once.
 static void
 write_log(void)
 {
+  struct buf *to[LOGSIZE];
   int tail;
 
+  for (tail = 0; tail < log.lh.n; tail++)
+    to[tail] = bread_async(log.dev, log.start+tail+1); // log block
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    bwait(to[tail]);
+    memmove(to[tail]->data, from->data, BSIZE);
+    to[tail]->flags |= B_DIRTY;
     brelse(from);
-    brelse(to);
+  }
+  bsubmit(to, log.lh.n);  // write the log
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(to[tail]);
+    brelse(to[tail]);
   }
 }
 
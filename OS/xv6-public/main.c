@@ -28,11 +28,18 @@ main(void)
   uartinit();      // serial port
   pinit();         // process table
   tvinit();        // trap vectors
+  slabinit();      // kernel object caches
   binit();         // buffer cache
   fileinit();      // file table
+  pipeinit();      // pipe cache
+  shminit();       // shared memory segments
+  mmapinit();      // mapped files
+  swapinit();      // swap area
+  ksminit();       // same-page merging
+  pciinit();       // PCI devices
   ideinit();       // disk 
   startothers();   // start other processors
-  kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  kinit2();        // must come after startothers()
   initUtable();
   userinit();      // first user process
   mpmain();        // finish this processor's setup
@@ -82,7 +89,7 @@ startothers(void)
     // Tell entryother.S what stack to use, where to enter, and what
     // pgdir to use. We cannot use kpgdir yet, because the AP processor
     // is running in low  memory, so we use entrypgdir for the APs too.
-    stack = kalloc();
+    stack = kalloc_order(KSTACKORDER);
     *(void**)(code-4) = stack + KSTACKSIZE;
     *(void(**)(void))(code-8) = mpenter;
     *(int**)(code-12) = (void *) V2P(entrypgdir);
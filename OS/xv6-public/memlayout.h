@@ -1,13 +1,30 @@
 // Memory layout
 
+#define E820MAP 0x500              // BIOS memory map left by bootasm.S
 #define EXTMEM  0x100000            // Start of extended memory
-#define PHYSTOP 0xE000000           // Top physical memory
+#define DEFPHYSTOP 0xE000000        // Top physical memory if the BIOS gives no map
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
+#define PHYSTOP (DEVSPACE-KERNBASE) // Most physical memory the kernel can map
 
 // Key addresses for address space layout (see kmap in vm.c for layout)
 #define KERNBASE 0x80000000         // First kernel virtual address
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
 
+// User address space: the heap grows from 0 up to USERTOP; above
+// it are NTHREAD thread stack windows of TSTACKMAX bytes each,
+// mmap()ed files, then the NSHM shared memory windows of SHMSIZE
+// bytes each.
+#define SHMSIZE  0x400000           // Largest shared memory segment
+#define SHMBASE  (KERNBASE-NSHM*SHMSIZE)
+#define MMAPBASE (SHMBASE-0x10000000)  // 256MB for mmap()
+#define TSTACKMAX 0x100000          // Thread stack window, guard page included
+#define TSTACKTOP MMAPBASE
+#define TSTACKBASE (TSTACKTOP-NTHREAD*TSTACKMAX)
+// Thread stack window i spans [TSTACKWIN(i) - TSTACKMAX, TSTACKWIN(i));
+// its bottom page is never mapped and guards the stack below.
+#define TSTACKWIN(i) (TSTACKBASE + ((i)+1)*TSTACKMAX)
+#define USERTOP  TSTACKBASE         // Top of the heap
+
 #define V2P(a) (((uint) (a)) - KERNBASE)
 #define P2V(a) ((void *)(((char *) (a)) + KERNBASE))
 
@@ -0,0 +1,32 @@
+// Memory use of the whole system, in pages.
+struct memstat {
+  uint total;     // physical memory managed by kalloc
+  uint free;      // free, including the zero pool
+  uint zeroed;    // free and already zeroed
+  uint user;      // resident user pages, summed over processes
+  uint pgtab;     // page-table pages, kernel and user
+  uint kstack;    // kernel stacks
+  uint slab;      // slab caches: open files, pipes, ...
+  uint pipe;      //   of which pipes
+  uint swap;      // user pages out on swap
+  uint swaptotal; // size of the swap area
+  uint ksm;       // merged pages
+  uint ksmsaved;  // pages that merging saves
+  uint bcache;    // disk block cache data
+  uint bhot;      //   of which blocks that are reused
+  uint bhit;      // block lookups that hit the cache (a count)
+  uint bmiss;     // block lookups that missed (a count)
+};
+
+// Memory use of one process, in pages except for sz.
+struct procmem {
+  int pid;
+  int nthread;
+  uint sz;        // heap size in bytes
+  uint rss;       // resident user pages
+  uint shm;       //   of which pages shared with other processes
+  uint swap;      // user pages out on swap
+  uint pgtab;     // page-table pages
+  uint kstack;    // kernel stacks
+  char name[16];
+};
@@ -18,17 +18,18 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | free bit map | data blocks | swap ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
+int fssize = FSSIZE;  // Size of the file system in blocks
+int nbitmap;
 int ninodeblocks = NINODES / IPB + 1;
 int nlog = LOGSIZE;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
+int nswap = SWAPSIZE;  // Number of swap blocks after the file system
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -40,6 +41,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint bmap(struct dinode *din, uint fbn);
 
 // convert to intel byte order
 ushort
@@ -76,8 +78,20 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-w") == 0)
+      nswap = atoi(argv[2]);
+    else if(strcmp(argv[1], "-s") == 0)
+      fssize = atoi(argv[2]);
+    else
+      break;
+    argv += 2;
+    argc -= 2;
+  }
+  nbitmap = fssize/(BSIZE*8) + 1;
+  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  if(argc < 2 || argv[1][0] == '-' || nswap < 0 || fssize <= nmeta){
+    fprintf(stderr, "Usage: mkfs [-s size] [-w nswap] fs.img files...\n");
     exit(1);
   }
 
@@ -90,25 +104,28 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nblocks = fssize - nmeta;
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.swapstart = xint(fssize);
+  sb.nswap = xint(nswap);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // Unwritten blocks read as zeroes.
+  if(ftruncate(fsfd, (off_t)(fssize + nswap) * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -170,7 +187,7 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE){
     perror("lseek");
     exit(1);
   }
@@ -210,7 +227,7 @@ rinode(uint inum, struct dinode *ip)
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
+  if(lseek(fsfd, (off_t)sec * BSIZE, 0) != (off_t)sec * BSIZE){
     perror("lseek");
     exit(1);
   }
@@ -240,16 +257,18 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used < fssize);
+  for(b = 0; b*BPB < used; b++){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b*BPB + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", xint(sb.bmapstart) + b);
+    wsect(xint(sb.bmapstart) + b, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -261,7 +280,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -270,22 +288,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -297,3 +300,65 @@ iappend(uint inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+uint
+newblock(void)
+{
+  assert(freeblock < fssize);
+  return freeblock++;
+}
+
+// Return entry i of indirect block ind, allocating it if needed.
+uint
+imap(uint ind, uint i)
+{
+  uint a[NINDIRECT];
+
+  rsect(ind, (char*)a);
+  if(a[i] == 0){
+    a[i] = xint(newblock());
+    wsect(ind, (char*)a);
+  }
+  return xint(a[i]);
+}
+
+// Return the disk block of block fbn of din, allocating it if
+// needed, the way bmap() in fs.c does.  Blocks are handed out
+// in order, so the last extent grows unless another file's
+// block came in between.
+uint
+bmap(struct dinode *din, uint fbn)
+{
+  uint i, n, end, x;
+
+  end = 0;
+  for(i = 0; i < NEXTENT && (n = xint(din->addrs[2*i+1])) != 0; i++){
+    if(fbn < n)
+      return xint(din->addrs[2*i]) + fbn;
+    fbn -= n;
+    end = xint(din->addrs[2*i]) + n;
+  }
+  if(fbn == 0 && din->addrs[INDIRECT] == 0){
+    if(i > 0 && end == freeblock){
+      din->addrs[2*i-1] = xint(xint(din->addrs[2*i-1]) + 1);
+      return newblock();
+    }
+    if(i < NEXTENT){
+      din->addrs[2*i] = xint(freeblock);
+      din->addrs[2*i+1] = xint(1);
+      return newblock();
+    }
+  }
+
+  if(fbn < NINDIRECT){
+    if(din->addrs[INDIRECT] == 0)
+      din->addrs[INDIRECT] = xint(newblock());
+    return imap(xint(din->addrs[INDIRECT]), fbn);
+  }
+  fbn -= NINDIRECT;
+  assert(fbn < NINDIRECT*NINDIRECT);
+  if(din->addrs[DINDIRECT] == 0)
+    din->addrs[DINDIRECT] = xint(newblock());
+  x = imap(xint(din->addrs[DINDIRECT]), fbn / NINDIRECT);
+  return imap(x, fbn % NINDIRECT);
+}
@@ -0,0 +1,6 @@
+// mmap() protections and flags
+#define PROT_READ    0x1
+#define PROT_WRITE   0x2
+
+#define MAP_SHARED   0x1  // writes go back to the file
+#define MAP_PRIVATE  0x2  // writes stay in this process
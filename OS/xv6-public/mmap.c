@@ -0,0 +1,484 @@
+// Memory-mapped files.
+//
+// mmap() only records the mapping in the process's vma table;
+// pages are read from the inode by mmapfault() the first time
+// they are touched.  On munmap(), exec() and exit(), pages of a
+// MAP_SHARED mapping that the hardware marked dirty are written
+// back to the file through the log.  Pages beyond the end of the
+// file read as zeros and are never written back.  A PROT_NONE
+// mapping reserves its range but never maps a page.
+//
+// A page of a MAP_SHARED mapping is in memory once, however many
+// processes map that page of the file, whether they share it
+// through fork() or each called mmap().  Its PTEs carry PTE_SHM,
+// and the mpage table counts them; the page is freed with the
+// last one.  Each process writes the page back if its own PTE is
+// dirty, and so writes every process's changes.
+//
+// Mappings are placed in [MMAPBASE, SHMBASE).  mmaplock guards
+// every vma table, the PTEs in that range and the mpage table; it
+// is not held while reading or writing the file.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "mman.h"
+
+struct spinlock mmaplock;
+
+// A page of a file that MAP_SHARED mappings have in memory.
+struct mpage {
+  struct inode *ip;     // 0 if free
+  uint off;             // offset of the page in the file
+  uint pa;
+  int ref;              // number of PTEs naming the page
+  struct mpage *next;   // hash chain, or free list
+};
+
+#define MPHASH(ip, off) ((((uint)(ip) >> 4) + (off) / PGSIZE) % NMPAGE)
+
+struct {
+  struct mpage page[NMPAGE];
+  struct mpage *hash[NMPAGE];
+  struct mpage *free;
+  uint n;               // pages in use
+} mpages;
+
+void
+mmapinit(void)
+{
+  struct mpage *m;
+
+  initlock(&mmaplock, "mmap");
+  for(m = mpages.page; m < &mpages.page[NMPAGE]; m++){
+    m->next = mpages.free;
+    mpages.free = m;
+  }
+}
+
+// Find the page at offset off of ip.
+// Caller must hold mmaplock.
+static struct mpage*
+mpagefind(struct inode *ip, uint off)
+{
+  struct mpage *m;
+
+  for(m = mpages.hash[MPHASH(ip, off)]; m; m = m->next)
+    if(m->ip == ip && m->off == off)
+      return m;
+  return 0;
+}
+
+// Drop a PTE's reference to the page at offset off of ip, and
+// free the page with the last one.  Caller must hold mmaplock.
+static void
+mpageput(struct inode *ip, uint off)
+{
+  struct mpage *m, **pp;
+
+  if((m = mpagefind(ip, off)) == 0)
+    panic("mpageput");
+  if(--m->ref > 0)
+    return;
+  for(pp = &mpages.hash[MPHASH(ip, off)]; *pp != m; pp = &(*pp)->next)
+    ;
+  *pp = m->next;
+  kfree(P2V(m->pa));
+  m->ip = 0;
+  m->next = mpages.free;
+  mpages.free = m;
+  mpages.n--;
+}
+
+// Map the page at offset off of ip at va in pgdir.  If it is
+// not in memory, mem, if not 0, becomes that page; otherwise mem
+// is freed.  Returns 0, or -1 if the page could not be mapped.
+// Caller must hold mmaplock.
+static int
+mpagemap(pde_t *pgdir, uint va, struct inode *ip, uint off, char *mem,
+         uint perm)
+{
+  struct mpage *m;
+  uint h;
+
+  if((m = mpagefind(ip, off)) == 0){
+    if(mem == 0 || (m = mpages.free) == 0){
+      if(mem)
+        kfree(mem);
+      return -1;
+    }
+    mpages.free = m->next;
+    m->ip = ip;
+    m->off = off;
+    m->pa = V2P(mem);
+    m->ref = 0;
+    h = MPHASH(ip, off);
+    m->next = mpages.hash[h];
+    mpages.hash[h] = m;
+    mpages.n++;
+  } else if(mem)
+    kfree(mem);
+  m->ref++;
+  if(mappages(pgdir, (char*)va, PGSIZE, m->pa, perm | PTE_SHM) < 0){
+    mpageput(ip, off);
+    return -1;
+  }
+  return 0;
+}
+
+// Take the pages of MAP_SHARED mapping v out of pgdir, dropping
+// their references.  Caller must hold mmaplock.
+static void
+mpageunmap(pde_t *pgdir, struct vma *v)
+{
+  pte_t *pte;
+  uint a;
+
+  if(v->flags != MAP_SHARED)
+    return;
+  for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte && (*pte & PTE_P)){
+      mpageput(v->f->ip, v->off + (a - v->addr));
+      *pte = 0;
+    }
+  }
+}
+
+// Number of MAP_SHARED pages in memory.
+uint
+mmappages(void)
+{
+  return mpages.n;
+}
+
+// Find the mapping of p that contains va.
+// Caller must hold mmaplock.
+static struct vma*
+findvma(struct proc *p, uint va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Find room for len bytes among p's mappings.
+// Caller must hold mmaplock.
+static uint
+findroom(struct proc *p, uint len)
+{
+  struct vma *v, *w;
+  uint a;
+
+  // The lowest candidate is MMAPBASE or the end of some mapping.
+  a = MMAPBASE;
+  for(v = p->vma; v <= &p->vma[NVMA]; v++){
+    if(v < &p->vma[NVMA]){
+      if(v->len == 0)
+        continue;
+      a = v->addr + v->len;
+    }
+    if(a + len > SHMBASE)
+      continue;
+    for(w = p->vma; w < &p->vma[NVMA]; w++)
+      if(w->len && a < w->addr + w->len && w->addr < a + len)
+        break;
+    if(w == &p->vma[NVMA])
+      return a;
+  }
+  return 0;
+}
+
+// Map len bytes of f, starting at offset off, into the current
+// process.  Returns the address, or -1.
+int
+mmap(struct file *f, uint off, uint len, int prot, int flags)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint a;
+
+  if(f->type != FD_INODE || f->ip->type != T_FILE || !f->readable)
+    return -1;
+  if(len == 0 || off % PGSIZE || (prot & ~(PROT_READ|PROT_WRITE)))
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  len = PGROUNDUP(len);
+
+  acquire(&mmaplock);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len == 0)
+      break;
+  if(v == &p->vma[NVMA] || len > SHMBASE - MMAPBASE ||
+     (a = findroom(p, len)) == 0){
+    release(&mmaplock);
+    return -1;
+  }
+  v->addr = a;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = filedup(f);
+  v->off = off;
+  release(&mmaplock);
+  return a;
+}
+
+// Handle a fault at va: fill the page from the file if va is
+// in a mapping that allows the access.  Returns 0 if the access
+// can be retried, -1 if it is invalid.
+int
+mmapfault(uint va, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  struct file *f;
+  pte_t *pte;
+  uint off, perm;
+  char *mem;
+  int r, shared;
+
+  va = PGROUNDDOWN(va);
+  acquire(&mmaplock);
+  if((v = findvma(p, va)) == 0 || v->prot == 0 ||
+     (write && !(v->prot & PROT_WRITE))){
+    release(&mmaplock);
+    return -1;
+  }
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(pte && (*pte & PTE_P)){
+    // Filled by another thread meanwhile.
+    release(&mmaplock);
+    return 0;
+  }
+  off = v->off + (va - v->addr);
+  perm = PTE_U | ((v->prot & PROT_WRITE) ? PTE_W : 0);
+  shared = v->flags == MAP_SHARED;
+  if(shared && mpagefind(v->f->ip, off)){
+    // Another mapping has the page in memory.
+    r = mpagemap(p->pgdir, va, v->f->ip, off, 0, perm);
+    release(&mmaplock);
+    return r;
+  }
+  f = filedup(v->f);
+  release(&mmaplock);
+
+  if((mem = kzalloc()) == 0){
+    fileclose(f);
+    return -1;
+  }
+  ilock(f->ip);
+  readi(f->ip, mem, off, PGSIZE);  // fails past EOF: page stays zero
+  iunlock(f->ip);
+
+  r = 0;
+  acquire(&mmaplock);
+  v = findvma(p, va);
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(v == 0 || v->f != f)
+    r = -1;  // unmapped meanwhile
+  if(r < 0 || (pte && (*pte & PTE_P)))
+    kfree(mem);
+  else if(shared)
+    r = mpagemap(p->pgdir, va, f->ip, off, mem, perm);
+  else if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), perm) < 0)
+    kfree(mem);
+  release(&mmaplock);
+  fileclose(f);
+  return r;
+}
+
+// Fault in the pages of [va, va+len) that lie in mappings,
+// so that the kernel can use them for a system call that
+// reads them, or writes them if write is set.
+void
+mmapfaultin(uint va, uint len, int write)
+{
+  uint a;
+
+  if(va < MMAPBASE || va + len < va || va + len > SHMBASE)
+    return;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    mmapfault(a, write);
+}
+
+// Write the dirty pages of a MAP_SHARED mapping back to f,
+// a few blocks per transaction as filewrite() does.
+static void
+writeback(struct proc *p, uint addr, uint len, struct file *f, uint off)
+{
+  struct inode *ip = f->ip;
+  int max = MAXOPWRITE;
+  uint a, i, n;
+  pte_t *pte;
+  char *mem;
+
+  for(a = addr; a < addr + len; a += PGSIZE, off += PGSIZE){
+    pte = walkpgdir(p->pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & (PTE_P|PTE_D)) != (PTE_P|PTE_D))
+      continue;
+    mem = P2V(PTE_ADDR(*pte));
+    for(i = 0; i < PGSIZE; i += n){
+      begin_op();
+      ilock(ip);
+      n = 0;
+      if(off + i < ip->size){
+        n = ip->size - (off + i);
+        if(n > PGSIZE - i)
+          n = PGSIZE - i;
+        if(n > max)
+          n = max;
+        writei(ip, mem + i, off + i, n);
+      }
+      iunlock(ip);
+      end_op();
+      if(n == 0)
+        break;
+    }
+    *pte &= ~PTE_D;
+  }
+}
+
+// Write back and remove mapping v of p.
+// Caller must not hold mmaplock.
+static void
+unmap(struct proc *p, struct vma *v)
+{
+  struct file *f;
+  uint addr, len, off;
+  int flags, prot;
+
+  acquire(&mmaplock);
+  addr = v->addr;
+  len = v->len;
+  if(len == 0){
+    release(&mmaplock);
+    return;
+  }
+  flags = v->flags;
+  prot = v->prot;
+  off = v->off;
+  f = filedup(v->f);
+  release(&mmaplock);
+
+  // Only a writable shared mapping of a writable file can
+  // have changes to write back.
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && f->writable)
+    writeback(p, addr, len, f, off);
+
+  acquire(&mmaplock);
+  if(v->addr == addr && v->len == len && v->f == f){
+    mpageunmap(p->pgdir, v);
+    deallocuvm(p->pgdir, addr + len, addr);
+    flushtlb(p->pgdir, addr, len);
+    v->len = 0;
+    v->addr = 0;
+    release(&mmaplock);
+    fileclose(f);  // the mapping's reference
+  } else
+    release(&mmaplock);
+  fileclose(f);
+}
+
+// Remove the mapping that starts at addr and is len bytes long.
+int
+munmap(uint addr, uint len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  acquire(&mmaplock);
+  v = findvma(p, addr);
+  if(v == 0 || v->addr != addr || v->len != PGROUNDUP(len)){
+    release(&mmaplock);
+    return -1;
+  }
+  release(&mmaplock);
+  unmap(p, v);
+  return 0;
+}
+
+// Remove all mappings of the current process, for exit() and
+// exec().  Must be called before the page table goes away.
+void
+mmapexit(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    unmap(p, v);
+}
+
+// Give child np p's mappings, including the pages already
+// faulted in: the same pages for MAP_SHARED, copies for
+// MAP_PRIVATE.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  pte_t *pte;
+  char *mem;
+  uint a, perm;
+
+  acquire(&mmaplock);
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    *nv = *v;
+    if(v->len == 0)
+      continue;
+    nv->f = filedup(v->f);
+    for(a = v->addr; a < v->addr + v->len; a += PGSIZE){
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if(pte == 0 || !(*pte & PTE_P))
+        continue;
+      if(v->flags == MAP_SHARED){
+        // Dirty only in p, which writes it back.
+        perm = PTE_FLAGS(*pte) & ~(PTE_P|PTE_A|PTE_D|PTE_SHM);
+        if(mpagemap(np->pgdir, a, v->f->ip, v->off + (a - v->addr), 0,
+                    perm) < 0)
+          goto bad;
+        continue;
+      }
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, P2V(PTE_ADDR(*pte)), PGSIZE);
+      if(mappages(np->pgdir, (char*)a, PGSIZE, V2P(mem),
+                  PTE_FLAGS(*pte)) < 0){
+        kfree(mem);
+        goto bad;
+      }
+    }
+  }
+  release(&mmaplock);
+  return 0;
+
+bad:
+  // The caller frees np's page table, and with it the private
+  // pages.
+  for(nv++; nv < &np->vma[NVMA]; nv++)
+    nv->len = 0;
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++)
+    if(nv->len)
+      mpageunmap(np->pgdir, nv);
+  release(&mmaplock);
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->len)
+      fileclose(nv->f);
+    nv->len = 0;
+  }
+  return -1;
+}
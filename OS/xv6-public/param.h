@@ -1,15 +1,24 @@
 #define NPROC        64  // maximum number of processes
 #define NTHREAD      32
 #define KSTACKSIZE 4096  // size of per-process kernel stack
+#define KSTACKORDER   0  // KSTACKSIZE is 2^KSTACKORDER pages
+#define MAXORDER     10  // largest kalloc_order() block is 2^MAXORDER pages
+#define NZEROPAGE    64  // pre-zeroed pages kept ready for kzalloc()
+#define NSHM         16  // maximum number of shared memory segments
+#define NKSM       1024  // maximum number of merged pages
+#define KSMBATCH      8  // pages ksmscan() looks at per idle loop
+#define NVMA          8  // mmap()ed regions per process
+#define NMPAGE     1024  // maximum number of MAP_SHARED pages in memory
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define MAXOPBLOCKS  20  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define NBUF         (LOGSIZE*3)  // minimum size of disk block cache
+#define BCACHEFRAC   32  // disk block cache may use 1/BCACHEFRAC of memory
+#define FSSIZE      16384  // default size of file system made by mkfs, in blocks
+#define SWAPSIZE     2048  // most blocks of swap area after the file system
 
@@ -0,0 +1,101 @@
+// PCI configuration space, through configuration mechanism #1.
+//
+// pciinit() lists the functions on bus 0, which is all there
+// is on the machines xv6 runs on; drivers then look up their
+// device with pcifind() or pcifindid().
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "pci.h"
+
+#define PCI_CONFADDR  0xCF8
+#define PCI_CONFDATA  0xCFC
+#define NPCIDEV       32
+
+static struct pcidev pcidevs[NPCIDEV];
+static int npcidev;
+
+uint
+pciread(struct pcidev *d, uint off)
+{
+  outl(PCI_CONFADDR, 0x80000000 | d->bus<<16 | d->dev<<11 | d->func<<8 |
+       (off & 0xFC));
+  return inl(PCI_CONFDATA);
+}
+
+void
+pciwrite(struct pcidev *d, uint off, uint v)
+{
+  outl(PCI_CONFADDR, 0x80000000 | d->bus<<16 | d->dev<<11 | d->func<<8 |
+       (off & 0xFC));
+  outl(PCI_CONFDATA, v);
+}
+
+void
+pciinit(void)
+{
+  struct pcidev *d;
+  uint dev, func, id, class, i;
+
+  for(dev = 0; dev < 32; dev++){
+    for(func = 0; func < 8; func++){
+      if(npcidev == NPCIDEV)
+        return;
+      d = &pcidevs[npcidev];
+      d->bus = 0;
+      d->dev = dev;
+      d->func = func;
+      id = pciread(d, PCI_ID);
+      if((id & 0xFFFF) == 0xFFFF){
+        if(func == 0)
+          break;  // no device
+        continue;
+      }
+      npcidev++;
+      d->vendor = id & 0xFFFF;
+      d->device = id >> 16;
+      class = pciread(d, PCI_CLASS);
+      d->class = class >> 24;
+      d->subclass = class >> 16;
+      for(i = 0; i < 6; i++)
+        d->bar[i] = pciread(d, PCI_BAR0 + 4*i);
+      d->irq = pciread(d, PCI_INTR);
+      if(func == 0 && (pciread(d, PCI_HEADER) & 0x800000) == 0)
+        break;  // single-function device
+    }
+  }
+}
+
+// The first function of the given class and subclass, or 0.
+struct pcidev*
+pcifind(int class, int subclass)
+{
+  struct pcidev *d;
+
+  for(d = pcidevs; d < &pcidevs[npcidev]; d++)
+    if(d->class == class && d->subclass == subclass)
+      return d;
+  return 0;
+}
+
+// The first function with the given vendor and device id, or 0.
+struct pcidev*
+pcifindid(int vendor, int device)
+{
+  struct pcidev *d;
+
+  for(d = pcidevs; d < &pcidevs[npcidev]; d++)
+    if(d->vendor == vendor && d->device == device)
+      return d;
+  return 0;
+}
+
+// Let d answer in I/O space and master the bus, for DMA.
+void
+pcimaster(struct pcidev *d)
+{
+  pciwrite(d, PCI_COMMAND,
+           pciread(d, PCI_COMMAND) | PCI_CMD_IO | PCI_CMD_MASTER);
+}
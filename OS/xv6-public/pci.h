@@ -0,0 +1,25 @@
+// A PCI function, as found by pciinit().
+struct pcidev {
+  uint bus, dev, func;
+  ushort vendor;
+  ushort device;
+  uchar class;
+  uchar subclass;
+  uchar irq;       // interrupt line
+  uint bar[6];     // base address registers
+};
+
+#define PCI_CLASS_STORAGE  0x01
+#define PCI_SUBCLASS_IDE   0x01
+
+// Configuration space registers.
+#define PCI_ID       0x00
+#define PCI_COMMAND  0x04
+#define PCI_CLASS    0x08
+#define PCI_HEADER   0x0C
+#define PCI_BAR0     0x10
+#define PCI_INTR     0x3C
+
+// PCI_COMMAND bits.
+#define PCI_CMD_IO      0x01  // respond to I/O space accesses
+#define PCI_CMD_MASTER  0x04  // may act as bus master, for DMA
@@ -5,6 +5,8 @@
 #include "mmu.h"
 #include "x86.h"
 #include "proc.h"
+#include "traps.h"
+#include "memstat.h"
 #include "spinlock.h"
 
 struct {
@@ -17,6 +19,7 @@ int nextpid = 1;
 int nexttid = 1;
 extern void forkret(void);
 extern void trapret(void);
+extern pde_t *kpgdir;
 
 static void wakeup1(void *chan);
 
@@ -102,12 +105,15 @@ found:
   t = MAINTHD(p);
   t->state = EMBRYO;
   t->tid = nexttid++;
+  t->ustack = 0;
+  memset(p->tstack, 0, sizeof(p->tstack));
+  p->tstacksize = PGSIZE;
 #endif
 
   release(&ptable.lock);
 
 #if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
-  if(!(t->kstack = kalloc())){
+  if(!(t->kstack = kalloc_order(KSTACKORDER))){
     p->state = UNUSED;
     t->state = UNUSED;
     return 0;
@@ -127,7 +133,7 @@ found:
   p->tid = 0;
 #else
   // Allocate kernel stack.
-  if((p->kstack = kalloc()) == 0){
+  if((p->kstack = kalloc_order(KSTACKORDER)) == 0){
     p->state = UNUSED;
     return 0;
   }
@@ -219,25 +225,37 @@ growproc(int n)
   uint sz;
   struct proc *curproc = myproc();
 
+  // allocuvm() cannot swap pages out under ptable.lock: make
+  // room for the pages and their page tables first.
+  if(n > 0)
+    swapreserve(PGROUNDUP(n)/PGSIZE + PGROUNDUP(n)/LPGSIZE + 2);
+
 #if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
   acquire(&ptable.lock);
 #endif
 
   sz = curproc->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    // New PTEs were not present before, so nothing is in the TLB.
+    if((sz = allocuvm(curproc->pgdir, sz, sz + n, curproc->largepage)) == 0)
+      goto bad;
   } else if(n < 0){
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+      goto bad;
+    flushtlb(curproc->pgdir, sz, curproc->sz - sz);
   }
   curproc->sz = sz;
-  switchuvm(curproc);
 
 #if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
   release(&ptable.lock);
 #endif
   return 0;
+
+bad:
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  release(&ptable.lock);
+#endif
+  return -1;
 }
 
 // Create a new process copying p as the parent.
@@ -254,13 +272,19 @@ fork(void)
   if((np = allocproc()) == 0)
     return -1;
 
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
+  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz, 0)) == 0 ||
+     mmapfork(curproc, np) < 0){
+    if(np->pgdir)
+      freevm(np->pgdir);
+    np->pgdir = 0;
+    kfree_order(np->kstack, KSTACKORDER);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
   np->sz = curproc->sz;
+  np->largepage = curproc->largepage;
+  np->ksm = curproc->ksm;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
@@ -284,16 +308,27 @@ fork(void)
     return -1;
   
   main_thd = MAINTHD(np);
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(main_thd->kstack);
+  // Stack windows only grow, so take their sizes before copying:
+  // anything mapped later is simply found already there.
+  memmove(np->tstack, curproc->tstack, sizeof(np->tstack));
+  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz, np->tstack)) == 0 ||
+     mmapfork(curproc, np) < 0){
+    if(np->pgdir)
+      freevm(np->pgdir);
+    np->pgdir = 0;
+    kfree_order(main_thd->kstack, KSTACKORDER);
     main_thd->kstack = 0;
     np->state = UNUSED;
     main_thd->state = UNUSED;
     return -1;
   }
   np->sz = curproc->sz;
+  np->largepage = curproc->largepage;
+  np->ksm = curproc->ksm;
+  np->tstacksize = curproc->tstacksize;
   np->parent = curproc;
   *(main_thd->tf) = *(CURTHD(curproc)->tf);
+  main_thd->ustack = CURTHD(curproc)->ustack;
 
   main_thd->tf->eax = 0;
   for(i = 0; i < NOFILE; i++)
@@ -330,6 +365,9 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  mmapexit();
+  shmrelease(curproc->pid);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
@@ -393,13 +431,14 @@ wait(void)
           t = THDADDR(p, i);
           t->tid = 0;
           t->state = UNUSED;
+          t->ustack = 0;
           if(t->kstack) {
-            kfree(t->kstack);
+            kfree_order(t->kstack, KSTACKORDER);
             t->kstack = 0;
           }
         }
 #else
-        kfree(p->kstack);
+        kfree_order(p->kstack, KSTACKORDER);
         p->kstack = 0;
         p->levelOfQueue = 0;
         p->ticks = 0;
@@ -441,10 +480,12 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int ran;
   c->proc = 0;
   
   for(;;){
     sti();
+    ran = 0;
 
     // Loop over process table looking for process to run.
     acquire(&ptable.lock);
@@ -467,6 +508,7 @@ scheduler(void)
         p->state = RUNNING;
         // cprintf("ticks = %d, pid = %d, name = %s\n", ticks, p->pid, p->name);
         swtch(&(c->scheduler), p->context);
+        ran = 1;
         switchkvm();
         c->proc = 0;
       }
@@ -485,6 +527,7 @@ scheduler(void)
         point->state = RUNNING;
         // cprintf("ticks = %d, pid = %d, name = %s\n", ticks, point->pid, point->name);
         swtch(&(c->scheduler), point->context);
+        ran = 1;
         switchkvm();
         c->proc = 0;
       }
@@ -522,6 +565,7 @@ scheduler(void)
       switchuvm(point);
       point->state = RUNNING;
       swtch(&(c->scheduler), point->context);
+      ran = 1;
       switchkvm();
       c->proc = 0;
     }
@@ -539,19 +583,30 @@ scheduler(void)
         if(t->state == RUNNABLE){
           p->tid = t - p->thds;
           c->proc = p;
-          switchuvm(p);
+          switchthd(p);
           t->state = RUNNING;
           swtch(&(c->scheduler), t->context);
-          switchkvm();
+          ran = 1;
           c->proc = 0;
         }
         if (infinity && t == CURTHD(p))
           break;
         infinity = 1;
       }
+      // Sibling threads ran on p's page table without reloading
+      // it; leave it before p can be freed.
+      if(c->pgdir != kpgdir)
+        switchkvm();
     }
 #endif
     release(&ptable.lock);
+
+    // Nothing was runnable: use the time to zero a free page
+    // and to look for pages to merge.
+    if(!ran){
+      kzeroidle();
+      ksmscan();
+    }
   }
 }
 
@@ -841,15 +896,76 @@ release_ptable_lock(void)
   release(&ptable.lock);
 }
 
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+#define TSTACKIDX(top) (((top) - TSTACKBASE) / TSTACKMAX - 1)
+
+// Give a new thread of p a user stack of p->tstacksize bytes.
+// The windows of joined threads keep their pages, so take the free
+// window with the most already mapped and map only what it lacks.
+// Returns the top of the stack, or 0.  Caller must hold ptable.lock.
+static uint
+ustackalloc(struct proc *p)
+{
+  char inuse[NTHREAD];
+  struct thd *t;
+  int i, best;
+  uint top;
+
+  memset(inuse, 0, sizeof(inuse));
+  for(t = MAINTHD(p); t < THDADDR(p, NTHREAD); t++)
+    if(t->state != UNUSED && t->ustack)
+      inuse[TSTACKIDX(t->ustack)] = 1;
+  best = -1;
+  for(i = 0; i < NTHREAD; i++)
+    if(!inuse[i] && (best < 0 || p->tstack[i] > p->tstack[best]))
+      best = i;
+  if(best < 0)
+    return 0;
+
+  top = TSTACKWIN(best);
+  if(p->tstack[best] < p->tstacksize){
+    if(uvmmap(p->pgdir, top - p->tstacksize,
+              p->tstacksize - p->tstack[best]) < 0)
+      return 0;
+    p->tstack[best] = p->tstacksize;
+  }
+  return top;
+}
+#endif
+
+// Set the user stack size of threads created from now on.
+// Kept across fork and exec.  Returns the previous size.
+int
+thread_stacksize(int size)
+{
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  struct proc *curproc = myproc();
+  int old;
+
+  if(size <= 0 || size > TSTACKMAX - PGSIZE)
+    return -1;
+  acquire(&ptable.lock);
+  old = curproc->tstacksize;
+  curproc->tstacksize = PGROUNDUP(size);
+  release(&ptable.lock);
+  return old;
+#else
+  return -1;
+#endif
+}
+
 int 
 thread_create(thread_t *thread, void *start_routine, void *arg)
 {
 #if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
-  uint sz, sp;
+  uint sp;
   int tidx;
   struct thd *t;
   struct proc *curproc = myproc();
 
+  // ustackalloc() cannot swap pages out under ptable.lock.
+  swapreserve(curproc->tstacksize/PGSIZE + 1);
+
   acquire(&ptable.lock);
   for(tidx = 0; tidx < NTHREAD; tidx++)
     if((t = THDADDR(curproc, tidx))->state == UNUSED)
@@ -863,7 +979,7 @@ found:
   t->tid = nexttid++;
   *thread = t->tid;
 
-  if ((t->kstack = kalloc()) == 0)
+  if ((t->kstack = kalloc_order(KSTACKORDER)) == 0)
     goto bad;
   sp = (uint)(t->kstack + KSTACKSIZE);
 
@@ -879,11 +995,9 @@ found:
   memset(t->context, 0, sizeof *t->context);
   t->context->eip = (uint)forkret;
 
-  sz = PGROUNDUP(curproc->sz);
-  if(!(sz = allocuvm(curproc->pgdir, sz, sz + PGSIZE)))
+  if((t->ustack = ustackalloc(curproc)) == 0)
     goto bad;
-  curproc->sz = sz;
-  sp = sz;
+  sp = t->ustack;
   sp -= 4;
   *(uint *)sp = (uint)arg;
   sp -= 4;
@@ -897,6 +1011,8 @@ found:
   return 0;
 
 bad:
+  if(t->kstack)
+    kfree_order(t->kstack, KSTACKORDER);
   t->kstack = 0;
   t->tid = 0;
   t->state = UNUSED;
@@ -953,11 +1069,12 @@ found:
   if (retval != 0)
     *retval = t->retval;
 
-  kfree(t->kstack);
+  kfree_order(t->kstack, KSTACKORDER);
   t->kstack = 0;
   t->retval = 0;
   t->tid = 0;
   t->state = UNUSED;
+  t->ustack = 0;  // its stack stays mapped for the next thread
 
   release(&ptable.lock);
 
@@ -966,4 +1083,274 @@ found:
   panic("Cannot call thread_join.");
   return -1;
 #endif
-}
\ No newline at end of file
+}
+
+// The trap frame at the top of a kernel stack: the one saved
+// when the thread last entered the kernel from user space.
+#define TOPTF(kstack) ((struct trapframe*)((kstack) + KSTACKSIZE) - 1)
+
+// Keep swapvictim() off [va, va+len) of the current process
+// until the current system call returns, because the kernel will
+// use it under a spinlock, where it cannot fault it back in.
+void
+pinuser(uint va, uint len)
+{
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  struct thd *t = CURTHD(myproc());
+#else
+  struct proc *t = myproc();
+#endif
+
+  va = PGROUNDDOWN(va);
+  len = PGROUNDUP(va + len);
+  if(t->pinva == t->pinend){
+    t->pinva = va;
+    t->pinend = len;
+    return;
+  }
+  if(va < t->pinva)
+    t->pinva = va;
+  if(len > t->pinend)
+    t->pinend = len;
+}
+
+// Drop the current thread's pins, at the end of a system call.
+void
+unpinuser(void)
+{
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  struct thd *t = CURTHD(myproc());
+#else
+  struct proc *t = myproc();
+#endif
+
+  t->pinva = t->pinend = 0;
+}
+
+// May p's page table be changed behind its back now, by
+// swapvictim() or ksmscan()?  Only if no kernel code is in the
+// middle of using p's pages by physical address, and no other CPU
+// has p's page table loaded: each thread of p is asleep, was
+// preempted by the timer in user space, or is the caller, whose
+// code expects to lose pages whenever it allocates one (see
+// copyrange()).  Pinned pages must be left alone in any case.
+// Caller must hold ptable.lock.
+int
+quiescent(struct proc *p)
+{
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  struct thd *t;
+
+  if(p->state != RUNNABLE || p->pgdir == 0)
+    return 0;
+  for(t = MAINTHD(p); t < THDADDR(p, NTHREAD); t++){
+    if(t->state == UNUSED || t->state == ZOMBIE || t->state == SLEEPING)
+      continue;
+    if(p == myproc() && t == CURTHD(p))
+      continue;
+    if(t->state != RUNNABLE || TOPTF(t->kstack)->trapno != T_IRQ0+IRQ_TIMER)
+      return 0;
+  }
+  return 1;
+#else
+  if(p->pgdir == 0)
+    return 0;
+  return p == myproc() || p->state == SLEEPING ||
+         (p->state == RUNNABLE &&
+          TOPTF(p->kstack)->trapno == T_IRQ0+IRQ_TIMER);
+#endif
+}
+
+// Is the page at va pinned by one of p's threads?
+// Caller must hold ptable.lock.
+int
+pinned(struct proc *p, uint va)
+{
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  struct thd *t;
+
+  for(t = MAINTHD(p); t < THDADDR(p, NTHREAD); t++)
+    if(t->state != UNUSED && va >= t->pinva && va < t->pinend)
+      return 1;
+  return 0;
+#else
+  return va >= p->pinva && va < p->pinend;
+#endif
+}
+
+// Clock hand for swapvictim().
+static struct proc *swaphand;
+static uint swapva;
+
+// Choose a user page to swap out, sweeping a clock hand over the
+// heaps of quiescent processes, the caller's own included: a page
+// whose accessed bit is set gets it cleared and another chance.
+// The chosen page's PTE is replaced by one naming swap slot slot,
+// and the page is returned for the caller to write out and free.
+// Returns 0 if there is no page to take.
+char*
+swapvictim(uint slot)
+{
+  struct proc *p;
+  pte_t *pte;
+  char *mem;
+  int n;
+
+  acquire(&ptable.lock);
+  if(swaphand == 0)
+    swaphand = ptable.proc;
+  // Twice around: the first trip may only clear accessed bits.
+  for(n = 0; n <= 2*NPROC; n++){
+    p = swaphand;
+    for(; quiescent(p) && swapva < p->sz; swapva += PGSIZE){
+      pte = walkpgdir(p->pgdir, (char*)swapva, 0);
+      if(pte == 0 || (*pte & PTE_PS)){
+        // No page table, or a 4MB page: skip the whole 4MB.
+        swapva = PGADDR(PDX(swapva) + 1, 0, 0) - PGSIZE;
+        continue;
+      }
+      if((*pte & (PTE_P|PTE_U|PTE_SHM|PTE_KSM)) != (PTE_P|PTE_U) ||
+         pinned(p, swapva))
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        // Only this CPU can have p loaded, if p is the caller's.
+        if(p == myproc())
+          flushtlb(p->pgdir, swapva, PGSIZE);
+        continue;
+      }
+      mem = P2V(PTE_ADDR(*pte));
+      *pte = (slot << PTXSHIFT) | (*pte & (PTE_U|PTE_W)) | PTE_SWAP;
+      if(p == myproc())
+        flushtlb(p->pgdir, swapva, PGSIZE);
+      swapva += PGSIZE;
+      release(&ptable.lock);
+      return mem;
+    }
+    swapva = 0;
+    if(++swaphand == &ptable.proc[NPROC])
+      swaphand = ptable.proc;
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
+// Clock hand for ksmscan().
+static struct proc *ksmhand;
+static uint ksmva;
+
+// Offer the next KSMBATCH heap pages of processes that asked for
+// merging to ksmmerge().  Called by the scheduler when idle.
+void
+ksmscan(void)
+{
+  struct proc *p;
+  pte_t *pte;
+  int n;
+
+  acquire(&ptable.lock);
+  if(ksmhand == 0)
+    ksmhand = ptable.proc;
+  for(n = 0; n < KSMBATCH; n++){
+    p = ksmhand;
+    if(p->ksm && quiescent(p) && ksmva < p->sz){
+      pte = walkpgdir(p->pgdir, (char*)ksmva, 0);
+      if(pte == 0 || (*pte & PTE_PS))
+        ksmva = PGADDR(PDX(ksmva) + 1, 0, 0);
+      else {
+        if((*pte & (PTE_P|PTE_U|PTE_W|PTE_SHM|PTE_KSM)) == (PTE_P|PTE_U|PTE_W) &&
+           !pinned(p, ksmva))
+          ksmmerge(p, ksmva, pte);
+        ksmva += PGSIZE;
+      }
+      continue;
+    }
+    ksmva = 0;
+    if(++ksmhand == &ptable.proc[NPROC]){
+      ksmhand = ptable.proc;
+      ksmpass();
+    }
+  }
+  release(&ptable.lock);
+}
+
+// Fill in *pm for process p.  Caller must hold ptable.lock.
+static void
+procmem1(struct proc *p, struct procmem *pm)
+{
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  struct thd *t;
+#endif
+
+  pm->pid = p->pid;
+  pm->sz = p->sz;
+  safestrcpy(pm->name, p->name, sizeof(pm->name));
+  if(p->pgdir)
+    uvmstat(p->pgdir, pm);
+  else
+    pm->rss = pm->shm = pm->swap = pm->pgtab = 0;
+  pm->nthread = 0;
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+  for(t = MAINTHD(p); t < THDADDR(p, NTHREAD); t++)
+    if(t->kstack)
+      pm->nthread++;
+#else
+  if(p->kstack)
+    pm->nthread = 1;
+#endif
+  pm->kstack = pm->nthread << KSTACKORDER;
+}
+
+// Fill in user array pm[0..n-1] with the memory use of up to
+// n processes.  Returns the number filled in.
+int
+procmem(struct procmem *pm, int n)
+{
+  struct procmem m;
+  struct proc *p;
+  int i;
+
+  i = 0;
+  for(p = ptable.proc; p < &ptable.proc[NPROC] && i < n; p++){
+    acquire(&ptable.lock);
+    if(p->state == UNUSED){
+      release(&ptable.lock);
+      continue;
+    }
+    procmem1(p, &m);
+    release(&ptable.lock);
+    // Writing user memory may fault, so hold no lock.
+    pm[i++] = m;
+  }
+  return i;
+}
+
+// Fill in *ms with the memory use of the whole system.
+// ms must be kernel memory: it is written under locks.
+void
+memstat(struct memstat *ms)
+{
+  struct procmem pm;
+  struct proc *p;
+
+  kmemstat(ms);
+  swapstat(ms);
+  ksmstat(ms);
+  bstat(ms);
+  ms->slab = kmem_cache_pages(0);
+  ms->pipe = pipepages();
+  ms->pgtab = kvmpgtab();
+  ms->user = ms->kstack = 0;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->state == UNUSED)
+      continue;
+    procmem1(p, &pm);
+    ms->user += pm.rss - pm.shm;
+    ms->pgtab += pm.pgtab;
+    ms->kstack += pm.kstack;
+  }
+  release(&ptable.lock);
+  // Shared pages once, however many map them.
+  ms->user += shmpages() + mmappages();
+}
@@ -8,6 +8,8 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  pde_t *pgdir;                // Page table loaded in %cr3
+  volatile uint tlbflush;      // Must flush TLB for another CPU's flushtlb()?
 };
 
 extern struct cpu cpus[NCPU];
@@ -33,6 +35,16 @@ struct context {
 };
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+
+// A file region mapped by mmap(); unused if len is 0.
+struct vma {
+  uint addr;
+  uint len;                   // Bytes, a multiple of PGSIZE
+  int prot;                   // PROT_READ, PROT_WRITE
+  int flags;                  // MAP_SHARED or MAP_PRIVATE
+  struct file *f;
+  uint off;                   // File offset of addr
+};
 #if defined(MULTILEVEL_SCHED) || defined(MLFQ_SCHED)
 struct proc {
   uint sz;                    // Size of process memory (bytes)
@@ -45,12 +57,16 @@ struct proc {
   struct context *context;    // swtch() here to run process
   void *chan;                 // If non-zero, sleeping on chan
   int killed;                 // If non-zero, have been killed
+  int largepage;              // If non-zero, grow heap with 4MB pages
+  int ksm;                    // If non-zero, merge identical heap pages
   struct file *ofile[NOFILE]; // Open files
   struct inode *cwd;          // Current directory
+  struct vma vma[NVMA];       // mmap()ed files
   char name[16];              // Process name (debugging)
   int levelOfQueue;
   uint ticks;
   int priority;
+  uint pinva, pinend;         // User range pinned by pinuser()
 };
 #else
 struct thd {
@@ -61,6 +77,8 @@ struct thd {
   struct context *context;
   void *chan;
   void *retval;
+  uint ustack;                // Top of user stack window, or 0
+  uint pinva, pinend;         // User range pinned by pinuser()
 };
 
 struct proc {
@@ -70,11 +88,16 @@ struct proc {
   int pid;                    // Process ID
   struct proc *parent;        // Parent process
   int killed;                 // If non-zero, have been killed
+  int largepage;              // If non-zero, grow heap with 4MB pages
+  int ksm;                    // If non-zero, merge identical heap pages
   struct file *ofile[NOFILE]; // Open files
   struct inode *cwd;          // Current directory
+  struct vma vma[NVMA];       // mmap()ed files
   char name[16];              // Process name (debugging)
   thread_t tid;
   struct thd thds[NTHREAD];
+  uint tstack[NTHREAD];       // Bytes mapped in each thread stack window
+  uint tstacksize;            // User stack size of new threads
 };
 
 #define MAINTHD(P) ((P)->thds)
@@ -0,0 +1,38 @@
+// List processes.  With -m, also show their memory use in KB.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "memstat.h"
+
+struct procmem pm[NPROC];
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, mem;
+
+  mem = argc > 1 && strcmp(argv[1], "-m") == 0;
+  if(argc > 2 || (argc == 2 && !mem)){
+    printf(2, "usage: ps [-m]\n");
+    exit();
+  }
+  if((n = procmem(pm, NPROC)) < 0){
+    printf(2, "ps: procmem failed\n");
+    exit();
+  }
+  if(mem)
+    printf(1, "PID\tTHR\tSZ\tRSS\tSWAP\tPGTAB\tKSTACK\tNAME\n");
+  else
+    printf(1, "PID\tTHR\tNAME\n");
+  for(i = 0; i < n; i++){
+    if(mem)
+      printf(1, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%s\n", pm[i].pid,
+             pm[i].nthread, pm[i].sz/1024, pm[i].rss*4, pm[i].swap*4,
+             pm[i].pgtab*4, pm[i].kstack*4, pm[i].name);
+    else
+      printf(1, "%d\t%d\t%s\n", pm[i].pid, pm[i].nthread, pm[i].name);
+  }
+  exit();
+}
@@ -0,0 +1,246 @@
+// Shared memory segments.
+//
+// A segment is named by a non-zero key and backed by one
+// physically contiguous block from kalloc_order().  Segment id
+// is always mapped at the same place, the id'th SHMSIZE window
+// above SHMBASE, so attaching never has to search for room and
+// a page table alone tells which segments a process has
+// attached: their PTEs carry PTE_SHM.
+//
+// The memory is allocated on the first attach and freed, along
+// with the key, when the last attachment goes away, whether by
+// shmdt(), exec() or exit().  fork() shares the parent's
+// attachments with the child.  A segment nobody has attached yet
+// belongs to the process that created it, and goes away when
+// that process exits.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+struct shm {
+  int key;      // 0 if slot is free
+  int order;    // segment is 2^order pages
+  int ref;      // number of attached page tables
+  int creator;  // pid of creator, until first attached
+  char *mem;    // 0 until first attached
+};
+
+struct {
+  struct spinlock lock;
+  struct shm seg[NSHM];
+} shmtable;
+
+#define SHMVA(id) (SHMBASE + (id)*SHMSIZE)
+
+void
+shminit(void)
+{
+  initlock(&shmtable.lock, "shmtable");
+}
+
+// Is segment id mapped in pgdir?  Caller must hold shmtable.lock.
+static int
+attached(pde_t *pgdir, int id)
+{
+  pte_t *pte;
+
+  pte = walkpgdir(pgdir, (char*)SHMVA(id), 0);
+  return pte != 0 && (*pte & PTE_SHM);
+}
+
+static void shmunmap(pde_t*, int);
+
+// Map segment id into pgdir and take a reference.
+// Caller must hold shmtable.lock.
+static int
+shmmap(pde_t *pgdir, int id)
+{
+  struct shm *s = &shmtable.seg[id];
+
+  s->ref++;
+  s->creator = 0;
+  if(mappages(pgdir, (char*)SHMVA(id), PGSIZE << s->order, V2P(s->mem),
+              PTE_W|PTE_U|PTE_SHM) < 0){
+    shmunmap(pgdir, id);
+    return -1;
+  }
+  return 0;
+}
+
+// Unmap segment id from pgdir and drop its reference.
+// The last reference frees the memory and the segment's key.
+// Caller must hold shmtable.lock.
+static void
+shmunmap(pde_t *pgdir, int id)
+{
+  struct shm *s = &shmtable.seg[id];
+  pte_t *pte;
+  uint a;
+
+  for(a = 0; a < PGSIZE << s->order; a += PGSIZE){
+    // mappages() may have failed part-way.
+    if((pte = walkpgdir(pgdir, (char*)SHMVA(id) + a, 0)) == 0 ||
+       !(*pte & PTE_SHM))
+      break;
+    *pte = 0;
+  }
+  flushtlb(pgdir, SHMVA(id), a);
+  if(--s->ref > 0)
+    return;
+  kfree_order(s->mem, s->order);
+  s->mem = 0;
+  s->key = 0;
+}
+
+// Find or create the segment named key, at least size bytes long.
+// Returns its id, or -1.
+int
+shmget(int key, uint size)
+{
+  struct shm *s, *free;
+  int order;
+
+  if(key == 0 || size == 0 || size > SHMSIZE)
+    return -1;
+  for(order = 0; PGSIZE << order < size; order++)
+    ;
+
+  acquire(&shmtable.lock);
+  free = 0;
+  for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++){
+    if(s->key == key){
+      release(&shmtable.lock);
+      if(s->order < order)
+        return -1;
+      return s - shmtable.seg;
+    }
+    if(s->key == 0 && free == 0)
+      free = s;
+  }
+  if(free == 0){
+    release(&shmtable.lock);
+    return -1;
+  }
+  free->key = key;
+  free->order = order;
+  free->ref = 0;
+  free->creator = myproc()->pid;
+  free->mem = 0;
+  release(&shmtable.lock);
+  return free - shmtable.seg;
+}
+
+// Attach segment id to the current process.
+// Returns the address it is mapped at, or -1.
+int
+shmat(int id)
+{
+  struct shm *s;
+  pde_t *pgdir = myproc()->pgdir;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtable.seg[id];
+  acquire(&shmtable.lock);
+  if(s->key == 0 || attached(pgdir, id))
+    goto bad;
+  if(s->mem == 0){
+    if((s->mem = kalloc_order(s->order)) == 0)
+      goto bad;
+    memset(s->mem, 0, PGSIZE << s->order);
+  }
+  if(shmmap(pgdir, id) < 0)
+    goto bad;
+  release(&shmtable.lock);
+  return SHMVA(id);
+
+bad:
+  release(&shmtable.lock);
+  return -1;
+}
+
+// Detach the segment mapped at va from the current process.
+int
+shmdt(uint va)
+{
+  pde_t *pgdir = myproc()->pgdir;
+  int id;
+
+  if(va < SHMBASE || va >= KERNBASE || (va - SHMBASE) % SHMSIZE)
+    return -1;
+  id = (va - SHMBASE) / SHMSIZE;
+  acquire(&shmtable.lock);
+  if(!attached(pgdir, id)){
+    release(&shmtable.lock);
+    return -1;
+  }
+  shmunmap(pgdir, id);
+  release(&shmtable.lock);
+  return 0;
+}
+
+// Free the segments that process pid created but never
+// attached.  Called by exit().
+void
+shmrelease(int pid)
+{
+  struct shm *s;
+
+  acquire(&shmtable.lock);
+  for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++)
+    if(s->key && s->ref == 0 && s->creator == pid)
+      s->key = 0;
+  release(&shmtable.lock);
+}
+
+// Number of pages in segments that are attached somewhere.
+uint
+shmpages(void)
+{
+  struct shm *s;
+  uint n;
+
+  n = 0;
+  acquire(&shmtable.lock);
+  for(s = shmtable.seg; s < &shmtable.seg[NSHM]; s++)
+    if(s->mem)
+      n += 1 << s->order;
+  release(&shmtable.lock);
+  return n;
+}
+
+// Attach page table to to every segment attached to from.
+// Called by copyuvm() for fork().
+int
+shmfork(pde_t *from, pde_t *to)
+{
+  int id;
+
+  acquire(&shmtable.lock);
+  for(id = 0; id < NSHM; id++){
+    if(attached(from, id) && shmmap(to, id) < 0){
+      release(&shmtable.lock);
+      return -1;
+    }
+  }
+  release(&shmtable.lock);
+  return 0;
+}
+
+// Detach every segment from a page table that is about to be freed.
+void
+shmexit(pde_t *pgdir)
+{
+  int id;
+
+  acquire(&shmtable.lock);
+  for(id = 0; id < NSHM; id++)
+    if(attached(pgdir, id))
+      shmunmap(pgdir, id);
+  release(&shmtable.lock);
+}
@@ -0,0 +1,224 @@
+// Object-cache (slab) allocator for small, fixed-size kernel objects.
+//
+// Each cache hands out objects of one size. Objects are carved out
+// of single pages from kalloc(); the page starts with a struct slab
+// header, so kmem_cache_free() finds an object's slab by rounding
+// its address down to the page. Slabs with free objects sit on the
+// cache's partial list; a slab whose objects have all been freed is
+// given back to kalloc().
+//
+// In front of the slabs, every CPU keeps a small stack of free
+// objects per cache, so the common alloc/free pair touches neither
+// the cache lock nor the slab lists. A CPU refills or drains half
+// of its stack at a time when it runs empty or full.
+//
+// Interface:
+// * kmem_cache_create(name, size) at init time.
+// * kmem_cache_alloc(c) returns an uninitialized object, or 0.
+// * kmem_cache_free(c, obj) returns it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+#define NKMEMCACHE  16  // maximum number of caches
+#define CPUCACHE    16  // free objects each CPU keeps per cache
+#define SLABALIGN    8  // object alignment
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;     // partial list
+  struct slab *prev;
+  uint inuse;            // objects handed out from this slab
+  void *free;            // free objects, linked through their first word
+};
+
+struct cpucache {
+  uint avail;
+  void *obj[CPUCACHE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;             // object size, rounded up to SLABALIGN
+  uint perslab;          // objects per slab
+  struct slab partial;   // head of slabs that have free objects
+  uint nslab;            // slabs currently allocated
+  struct cpucache cpu[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NKMEMCACHE];
+  int n;
+} slabtable;
+
+#define SLABHDR ((sizeof(struct slab) + SLABALIGN-1) & ~(SLABALIGN-1))
+
+void
+slabinit(void)
+{
+  initlock(&slabtable.lock, "slabtable");
+}
+
+// Create a cache for objects of the given size.
+// Panics if there is no room; caches are only made at boot.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + SLABALIGN-1) & ~(SLABALIGN-1);
+  if(size < sizeof(void*) || size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: size");
+
+  acquire(&slabtable.lock);
+  if(slabtable.n == NKMEMCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &slabtable.cache[slabtable.n++];
+  release(&slabtable.lock);
+
+  memset(c, 0, sizeof(*c));
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->partial.next = c->partial.prev = &c->partial;
+  return c;
+}
+
+// Get a fresh slab from kalloc and put it on the partial list.
+// Caller must hold c->lock.
+static struct slab*
+slabgrow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+  uint i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  obj = (char*)s + SLABHDR;
+  for(i = 0; i < c->perslab; i++, obj += c->size){
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+  c->nslab++;
+  return s;
+}
+
+// Take one object out of the slabs.  Caller must hold c->lock.
+static void*
+slabget(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  s = c->partial.next;
+  if(s == &c->partial && (s = slabgrow(c)) == 0)
+    return 0;
+  obj = s->free;
+  s->free = *(void**)obj;
+  s->inuse++;
+  if(s->free == 0){
+    // Full: drop it from the partial list until something is freed.
+    s->next->prev = s->prev;
+    s->prev->next = s->next;
+    s->next = s->prev = 0;
+  }
+  return obj;
+}
+
+// Return one object to its slab.  Caller must hold c->lock.
+static void
+slabput(struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint)obj);
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  if(s->free == 0){
+    // Was full; back on the partial list.
+    s->next = c->partial.next;
+    s->prev = &c->partial;
+    c->partial.next->prev = s;
+    c->partial.next = s;
+  }
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(--s->inuse == 0){
+    s->next->prev = s->prev;
+    s->prev->next = s->next;
+    c->nslab--;
+    kfree((char*)s);
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct cpucache *cc;
+  void *obj;
+
+  pushcli();
+  cc = &c->cpu[cpuid()];
+  if(cc->avail == 0){
+    acquire(&c->lock);
+    while(cc->avail < CPUCACHE/2 && (obj = slabget(c)) != 0)
+      cc->obj[cc->avail++] = obj;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(cc->avail > 0)
+    obj = cc->obj[--cc->avail];
+  popcli();
+  return obj;
+}
+
+// Number of pages held by cache c's slabs, or by all caches if c is 0.
+uint
+kmem_cache_pages(struct kmem_cache *c)
+{
+  uint n;
+  int i;
+
+  if(c)
+    return c->nslab;
+  n = 0;
+  acquire(&slabtable.lock);
+  for(i = 0; i < slabtable.n; i++)
+    n += slabtable.cache[i].nslab;
+  release(&slabtable.lock);
+  return n;
+}
+
+// Free an object previously returned by kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct cpucache *cc;
+
+  pushcli();
+  cc = &c->cpu[cpuid()];
+  if(cc->avail == CPUCACHE){
+    acquire(&c->lock);
+    while(cc->avail > CPUCACHE/2)
+      slabput(c, cc->obj[--cc->avail]);
+    release(&c->lock);
+  }
+  cc->obj[cc->avail++] = obj;
+  popcli();
+}
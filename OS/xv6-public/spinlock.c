@@ -29,8 +29,10 @@ acquire(struct spinlock *lk)
     panic("acquire");
 
   // The xchg is atomic.
+  // Meanwhile answer TLB flushes: the holder may be waiting
+  // for this CPU in flushtlb(), and interrupts are off.
   while(xchg(&lk->locked, 1) != 0)
-    ;
+    tlbcheck();
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -0,0 +1,236 @@
+// Swapping of user pages.
+//
+// The swap area is a run of sb.nswap blocks that mkfs reserves on
+// the file system disk right after the file system.  It is cut
+// into page-sized slots.  A page that is out on swap keeps a PTE
+// without PTE_P, holding its slot number in place of the physical
+// address, its PTE_U and PTE_W bits, and PTE_SWAP.
+//
+// When memory runs out, swapout() asks swapvictim() in proc.c for
+// a cold page, chosen by a clock algorithm over the accessed bits
+// of sleeping and preempted processes and of the one allocating,
+// and writes it to a slot.  A later fault on the page reads it
+// back in swapin().
+//
+// Swap I/O goes straight to the disk with a private buffer, not
+// through the buffer cache.  The buffer's sleeplock is held from
+// choosing a victim until its page is written, so swapin() never
+// reads a slot that is still being filled.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "memstat.h"
+
+#define SECTPERPG (PGSIZE/BSIZE)
+#define NSLOT     (SWAPSIZE/SECTPERPG)
+
+// Slot states.
+enum { SLOT_FREE, SLOT_USED, SLOT_BUSY, SLOT_DEAD };
+
+struct {
+  struct spinlock lock;
+  uchar slot[NSLOT];  // SLOT_BUSY while being written;
+                      // SLOT_DEAD if freed while being written
+  struct buf buf;     // for swap I/O; its sleeplock serializes it
+  uchar data[BSIZE];  // buf's data
+} swap;
+
+extern struct superblock sb;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.buf.lock, "swapbuf");
+  swap.buf.data = swap.data;
+}
+
+// Number of usable slots: the swap area may be smaller than
+// SWAPSIZE, or missing altogether.
+static uint
+nslot(void)
+{
+  uint n;
+
+  n = sb.nswap / SECTPERPG;
+  return n < NSLOT ? n : NSLOT;
+}
+
+// Read or write page mem from or to slot.
+// Caller must hold swap.buf.lock.
+static void
+swaprw(uint slot, char *mem, int write)
+{
+  struct buf *b = &swap.buf;
+  int i;
+
+  b->dev = ROOTDEV;
+  for(i = 0; i < SECTPERPG; i++){
+    b->blockno = sb.swapstart + slot*SECTPERPG + i;
+    if(write){
+      memmove(b->data, mem + i*BSIZE, BSIZE);
+      b->flags = B_DIRTY;
+    } else
+      b->flags = 0;
+    iderw(b);
+    if(!write)
+      memmove(mem + i*BSIZE, b->data, BSIZE);
+  }
+}
+
+// Move one user page out to swap.
+// Returns 0 if a page was freed, -1 if none could be.
+int
+swapout(void)
+{
+  uint slot, n;
+  char *mem;
+
+  acquire(&swap.lock);
+  n = nslot();
+  for(slot = 0; slot < n; slot++)
+    if(swap.slot[slot] == SLOT_FREE)
+      break;
+  if(slot == n){
+    release(&swap.lock);
+    return -1;
+  }
+  swap.slot[slot] = SLOT_BUSY;
+  release(&swap.lock);
+
+  acquiresleep(&swap.buf.lock);
+  if((mem = swapvictim(slot)) != 0){
+    swaprw(slot, mem, 1);
+    kfree(mem);
+  }
+  // Still holding the buffer, so that swapin() cannot have
+  // taken the page back and freed the slot yet.
+  acquire(&swap.lock);
+  if(mem == 0 || swap.slot[slot] == SLOT_DEAD)
+    swap.slot[slot] = SLOT_FREE;
+  else
+    swap.slot[slot] = SLOT_USED;
+  release(&swap.lock);
+  releasesleep(&swap.buf.lock);
+  return mem ? 0 : -1;
+}
+
+// Swap out pages until n pages are free, or nothing more can go.
+// Lets callers that must allocate while holding a spinlock,
+// such as growproc(), make room beforehand.
+void
+swapreserve(int n)
+{
+  while(kfreepages() < n && swapout() == 0)
+    ;
+}
+
+// May the caller sleep, i.e. does it hold no spinlock?
+// Interrupts alone do not tell: page faults run with them off.
+static int
+cansleep(void)
+{
+  int ncli;
+
+  pushcli();
+  ncli = mycpu()->ncli;
+  popcli();
+  return ncli == 1;
+}
+
+// Allocate a zeroed page for user memory.  If memory is
+// exhausted and the caller may sleep, evict pages to make room.
+char*
+swapalloc(void)
+{
+  char *mem;
+
+  while((mem = kzalloc()) == 0 && cansleep() && swapout() == 0)
+    ;
+  return mem;
+}
+
+// Bring the page at va back in, if it is out on swap.
+// Returns 0 if the access can be retried, -1 if va is not
+// a swapped-out page.
+int
+swapin(pde_t *pgdir, uint va)
+{
+  pte_t *pte, old;
+  uint slot;
+  char *mem;
+
+  if(va >= KERNBASE || (pte = walkpgdir(pgdir, (char*)va, 0)) == 0)
+    return -1;
+  old = *pte;
+  if(!(old & PTE_SWAP))
+    return -1;
+  slot = PTE_ADDR(old) >> PTXSHIFT;
+
+  if((mem = swapalloc()) == 0)
+    return -1;
+  acquiresleep(&swap.buf.lock);
+  if(*pte == old){
+    swaprw(slot, mem, 0);
+    // Accessed, so that the clock does not take it straight back.
+    *pte = V2P(mem) | (old & (PTE_U|PTE_W)) | PTE_P | PTE_A;
+    acquire(&swap.lock);
+    swap.slot[slot] = SLOT_FREE;
+    release(&swap.lock);
+    mem = 0;
+  }
+  releasesleep(&swap.buf.lock);
+  if(mem)
+    kfree(mem);  // another thread brought it in meanwhile
+  return 0;
+}
+
+// Bring in every swapped-out page of [va, va+len), so that the
+// kernel can use them for a system call while holding a spinlock.
+void
+swapinrange(pde_t *pgdir, uint va, uint len)
+{
+  uint a;
+
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+    swapin(pgdir, a);
+}
+
+// Release the slot held by swapped-out PTE pte.
+void
+swapfree(pte_t pte)
+{
+  uint slot;
+
+  slot = PTE_ADDR(pte) >> PTXSHIFT;
+  acquire(&swap.lock);
+  if(swap.slot[slot] == SLOT_BUSY)
+    swap.slot[slot] = SLOT_DEAD;
+  else
+    swap.slot[slot] = SLOT_FREE;
+  release(&swap.lock);
+}
+
+// Fill in the swap part of *ms.
+void
+swapstat(struct memstat *ms)
+{
+  uint slot, n;
+
+  acquire(&swap.lock);
+  n = nslot();
+  ms->swap = 0;
+  for(slot = 0; slot < n; slot++)
+    if(swap.slot[slot] != SLOT_FREE)
+      ms->swap++;
+  ms->swaptotal = n;
+  release(&swap.lock);
+}
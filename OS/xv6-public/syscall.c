@@ -19,7 +19,8 @@ fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if((addr >= curproc->sz || addr+4 > curproc->sz) &&
+     !uvmcheck(curproc->pgdir, addr, 4, 0))
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -34,10 +35,15 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
-    return -1;
-  *pp = (char*)addr;
   ep = (char*)curproc->sz;
+  if(addr >= curproc->sz){
+    // Above the heap, e.g. on a thread stack: the string
+    // must end before the first unmapped page.
+    for(ep = (char*)PGROUNDDOWN(addr);
+        uvmcheck(curproc->pgdir, (uint)ep, PGSIZE, 0); ep += PGSIZE)
+      ;
+  }
+  *pp = (char*)addr;
   for(s = *pp; s < ep; s++){
     if(*s == 0)
       return s - *pp;
@@ -58,17 +64,27 @@ argint(int n, int *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process address space, and, if the kernel
+// will write to the block, that the user may write to it.
 int
-argptr(int n, char **pp, int size)
+argptr(int n, char **pp, int size, int write)
 {
   int i;
   struct proc *curproc = myproc();
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0)
     return -1;
+  if((uint)i >= curproc->sz || (uint)i+size > curproc->sz){
+    mmapfaultin(i, size, write);
+    if(!uvmcheck(curproc->pgdir, i, size, write))
+      return -1;
+  } else {
+    // Some callers copy under a spinlock and so cannot fault it in.
+    pinuser(i, size);
+    swapinrange(curproc->pgdir, i, size);
+  }
   *pp = (char*)i;
   return 0;
 }
@@ -121,6 +137,16 @@ extern int sys_setuser(void);
 extern int sys_verify(void);
 extern int sys_logout(void);
 extern int sys_chmod(void);
+extern int sys_largepage(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_thread_stacksize(void);
+extern int sys_memstat(void);
+extern int sys_procmem(void);
+extern int sys_ksm(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]          sys_fork,
@@ -158,6 +184,16 @@ static int (*syscalls[])(void) = {
 [SYS_verify]        sys_verify,
 [SYS_logout]        sys_logout,
 [SYS_chmod]         sys_chmod,
+[SYS_largepage]     sys_largepage,
+[SYS_shmget]        sys_shmget,
+[SYS_shmat]         sys_shmat,
+[SYS_shmdt]         sys_shmdt,
+[SYS_mmap]          sys_mmap,
+[SYS_munmap]        sys_munmap,
+[SYS_thread_stacksize] sys_thread_stacksize,
+[SYS_memstat]       sys_memstat,
+[SYS_procmem]       sys_procmem,
+[SYS_ksm]           sys_ksm,
 };
 
 void
@@ -170,6 +206,7 @@ syscall(void)
   struct thd *curthd = CURTHD(curproc);
 
   num = curthd->tf->eax;
+  unpinuser();
   if(num > 0 && num < NELEM(syscalls) && syscalls[num])
     curthd->tf->eax = syscalls[num]();
   else{
@@ -179,6 +216,7 @@ syscall(void)
   }
 #else
   num = curproc->tf->eax;
+  unpinuser();
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]){
     curproc->tf->eax = syscalls[num]();
   }
@@ -188,4 +226,5 @@ syscall(void)
     curproc->tf->eax = -1;
   }
 #endif
+  unpinuser();
 }
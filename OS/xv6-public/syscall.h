@@ -33,4 +33,14 @@
 #define SYS_setuser       32
 #define SYS_verify        33
 #define SYS_logout        34
-#define SYS_chmod         35
\ No newline at end of file
+#define SYS_chmod         35
+#define SYS_largepage     36
+#define SYS_shmget        37
+#define SYS_shmat         38
+#define SYS_shmdt         39
+#define SYS_mmap          40
+#define SYS_munmap        41
+#define SYS_thread_stacksize 42
+#define SYS_memstat       43
+#define SYS_procmem       44
+#define SYS_ksm           45
\ No newline at end of file
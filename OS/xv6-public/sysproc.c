@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "memstat.h"
 
 int
 sys_fork(void)
@@ -164,4 +165,102 @@ int sys_thread_join(void)
   if(argint(1, &retval) < 0)
     return -1;
   return thread_join((thread_t)thread, (void**)retval);
-}
\ No newline at end of file
+}
+
+int
+sys_thread_stacksize(void)
+{
+  int size;
+
+  if(argint(0, &size) < 0)
+    return -1;
+  return thread_stacksize(size);
+}
+
+// Turn 4MB pages for heap growth on (1) or off (0).
+// The setting is inherited by fork and kept across exec.
+// Returns the previous setting.
+int
+sys_largepage(void)
+{
+  int on, old;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  old = myproc()->largepage;
+  myproc()->largepage = (on != 0);
+  return old;
+}
+
+// Turn merging of identical heap pages on (1) or off (0).
+// The setting is inherited by fork and kept across exec.
+// Returns the previous setting.
+int
+sys_ksm(void)
+{
+  int on, old;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  old = myproc()->ksm;
+  myproc()->ksm = (on != 0);
+  return old;
+}
+
+int
+sys_shmget(void)
+{
+  int key, size;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0)
+    return -1;
+  return shmget(key, size);
+}
+
+int
+sys_shmat(void)
+{
+  int id;
+
+  if(argint(0, &id) < 0)
+    return -1;
+  return shmat(id);
+}
+
+int
+sys_shmdt(void)
+{
+  int addr;
+
+  if(argint(0, &addr) < 0)
+    return -1;
+  return shmdt(addr);
+}
+
+int
+sys_memstat(void)
+{
+  struct memstat *ms, m;
+
+  if(argptr(0, (void*)&ms, sizeof(*ms), 1) < 0)
+    return -1;
+  // Gather under locks into kernel memory, then copy out with
+  // none held: a write to a merged page faults into ksm.c.
+  memstat(&m);
+  *ms = m;
+  return 0;
+}
+
+// Fill in an array of n struct procmem.
+// Returns the number of processes filled in.
+int
+sys_procmem(void)
+{
+  struct procmem *pm;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0 || n > NPROC ||
+     argptr(0, (void*)&pm, n*sizeof(*pm), 1) < 0)
+    return -1;
+  return procmem(pm, n);
+}
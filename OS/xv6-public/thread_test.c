@@ -99,6 +99,22 @@ void *thread_sbrk(void *arg)
   thread_exit(arg);
   return 0;
 }
+void *thread_stack(void *arg)
+{
+  char buf[8192];
+  int i;
+
+  // Touches more than one page of stack.
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = (int)arg;
+  for (i = 0; i < sizeof(buf); i++) {
+    if (buf[i] != (char)(int)arg)
+      failed();
+  }
+  thread_exit(arg);
+  return 0;
+}
+
 void create_all(int n, void *(*entry)(void *))
 {
   int i;
@@ -161,6 +177,22 @@ int main(int argc, char *argv[])
   join_all(NUM_THREAD);
   printf(1, "Test 3 passed\n\n");
 
+  printf(1, "Test 4: Stack test\n");
+  if (thread_stacksize(16384) < 0) {
+    printf(1, "thread_stacksize failed\n");
+    failed();
+  }
+  char *brk = sbrk(0);
+  for (i = 0; i < 100; i++) {
+    create_all(NUM_THREAD, thread_stack);
+    join_all(NUM_THREAD);
+  }
+  if (sbrk(0) != brk) {
+    printf(1, "Thread stacks grew the heap\n");
+    failed();
+  }
+  printf(1, "Test 4 passed\n\n");
+
   printf(1, "All tests passed!\n");
   exit();
 }
@@ -103,6 +103,10 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_TLBFLUSH:
+    tlbcheck();
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -113,8 +117,30 @@ trap(struct trapframe *tf)
     cprintf("user interrupt 128 called!\n");
     exit();
 
+  case T_PGFLT:
+    // The page may be out on swap.  The kernel can fault on a user
+    // page too, but may only wait for it if it holds no spinlock.
+    if(myproc() && ((tf->cs&3) == DPL_USER || (tf->eflags & FL_IF)) &&
+       swapin(myproc()->pgdir, rcr2()) == 0)
+      break;
+    // A write to a merged page: copy it.  Needs no sleep, so
+    // kernel writes under a spinlock (e.g. piperead) work too.
+    if(myproc() && (tf->err & (FEC_PR|FEC_WR)) == (FEC_PR|FEC_WR) &&
+       ksmfault(myproc()->pgdir, rcr2()) == 0)
+      break;
+    // A user page fault may just be an mmap()ed page not read yet.
+    if(myproc() && (tf->cs&3) == DPL_USER &&
+       mmapfault(rcr2(), tf->err & FEC_WR) == 0)
+      break;
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    if(virtioirq != 0 && tf->trapno == T_IRQ0 + virtioirq){
+      virtiointr();
+      lapiceoi();
+      break;
+    }
     if(myproc() == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -22,9 +22,15 @@
 #define T_MCHK          18      // machine check
 #define T_SIMDERR       19      // SIMD floating point error
 
+// Page fault error code bits
+#define FEC_PR          0x1     // Page-level protection violation
+#define FEC_WR          0x2     // Caused by a write
+#define FEC_U           0x4     // Caused in user mode
+
 // These are arbitrarily chosen, but with care not to overlap
 // processor defined exceptions or interrupt vectors.
 #define T_SYSCALL       64      // system call
+#define T_TLBFLUSH      65      // IPI: flush user TLB entries
 #define T_DEFAULT      500      // catchall
 
 #define T_IRQ0          32      // IRQ 0 corresponds to int T_IRQ
@@ -2,89 +2,271 @@
 #include "stat.h"
 #include "user.h"
 #include "param.h"
+#include "memlayout.h"
+#include "x86.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator with size classes.
+//
+// Requests of up to MAXSMALL bytes are rounded up to one of NCLASS
+// power-of-two block sizes.  Free blocks of each class sit on a
+// singly linked list, so allocating and freeing them is O(1).
+// Every thread has its own cache of such lists, which it uses
+// without locking; a cache that runs empty or grows past CACHEMAX
+// blocks moves a batch of blocks from or to the shared lists.
+//
+// Larger requests get a run of whole pages.  Free runs are kept in
+// an address-ordered list and merged with their neighbours; a free
+// run at the top of the heap is given back with a negative sbrk().
+//
+// Each block starts with a Header that records its size.
 
-typedef long Align;
-
-union header {
+typedef union header {
   struct {
-    union header *ptr;
-    uint size;
+    union header *next;  // next free block, while free
+    uint size;           // block size in bytes, header included
   } s;
-  Align x;
+  long long align;
+} Header;
+
+#define NCLASS    8
+#define MINBLOCK  16                          // block size of class 0
+#define MAXSMALL  ((MINBLOCK << (NCLASS-1)) - sizeof(Header))
+#define SLABSIZE  (4*4096)  // carved into blocks when a class runs dry
+#define CACHEMAX  32        // blocks of a class a thread cache holds
+#define NCACHE    (NTHREAD+1)
+
+struct cache {
+  Header *free[NCLASS];
+  uint n[NCLASS];
 };
 
-typedef union header Header;
+static volatile uint lock;
+static Header *shared[NCLASS];  // free blocks, for all threads
+static Header *runs;            // free page runs, by address
+static struct cache caches[NCACHE];
 
-static Header base;
-static Header *freep;
+static void
+acquire(void)
+{
+  while(xchg(&lock, 1) != 0)
+    yield();
+}
 
-void
-free(void *ap)
+static void
+release(void)
+{
+  xchg(&lock, 0);
+}
+
+// The calling thread's cache.  Threads are told apart by their
+// stacks: each has its own window above the heap (see thread_create
+// in proc.c), and the main thread's stack is in the heap.
+static struct cache*
+mycache(void)
+{
+  uint sp;
+
+  sp = (uint)&sp;
+  if(sp >= TSTACKBASE && sp < TSTACKTOP)
+    return &caches[(sp - TSTACKBASE) / TSTACKMAX + 1];
+  return &caches[0];
+}
+
+static int
+sizeclass(uint nbytes)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  int c;
+
+  nbytes += sizeof(Header);
+  for(c = 0; (MINBLOCK << c) < nbytes; c++)
+    ;
+  return c;
 }
 
+// Free the page run hp.  Caller must hold lock.
+static void
+freerun(Header *hp)
+{
+  Header *prev, *p;
+
+  prev = 0;
+  for(p = runs; p != 0 && p < hp; p = p->s.next)
+    prev = p;
+  hp->s.next = p;
+  if(p && (char*)hp + hp->s.size == (char*)p){
+    hp->s.size += p->s.size;
+    hp->s.next = p->s.next;
+  }
+  if(prev && (char*)prev + prev->s.size == (char*)hp){
+    prev->s.size += hp->s.size;
+    prev->s.next = hp->s.next;
+  } else if(prev)
+    prev->s.next = hp;
+  else
+    runs = hp;
+
+  // The last run may end at the top of the heap: give it back.
+  prev = 0;
+  for(p = runs; p->s.next != 0; p = p->s.next)
+    prev = p;
+  if((char*)p + p->s.size == sbrk(0) && sbrk(-p->s.size) != (char*)-1){
+    if(prev)
+      prev->s.next = 0;
+    else
+      runs = 0;
+  }
+}
+
+// Allocate a page run of at least size bytes.  Caller must hold lock.
 static Header*
-morecore(uint nu)
+allocrun(uint size)
 {
-  char *p;
-  Header *hp;
+  Header **pp, *p, *rest;
+  char *mem;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+  size = (size + 4095) & ~4095;
+  for(pp = &runs; (p = *pp) != 0; pp = &p->s.next){
+    if(p->s.size < size)
+      continue;
+    if(p->s.size == size)
+      *pp = p->s.next;
+    else {
+      rest = (Header*)((char*)p + size);
+      rest->s.size = p->s.size - size;
+      rest->s.next = p->s.next;
+      *pp = rest;
+      p->s.size = size;
+    }
+    return p;
+  }
+  if((mem = sbrk(size)) == (char*)-1)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  p = (Header*)mem;
+  p->s.size = size;
+  return p;
+}
+
+// Refill thread cache c's list of class cl from the shared
+// lists, carving a new slab if they are empty.
+static void
+refill(struct cache *c, int cl)
+{
+  Header *hp, *p;
+  uint bsize, off;
+
+  bsize = MINBLOCK << cl;
+  acquire();
+  if(shared[cl] == 0 && (hp = allocrun(SLABSIZE)) != 0){
+    for(off = 0; off + bsize <= SLABSIZE; off += bsize){
+      p = (Header*)((char*)hp + off);
+      p->s.size = bsize;
+      p->s.next = shared[cl];
+      shared[cl] = p;
+    }
+  }
+  while(c->n[cl] < CACHEMAX/2 && (p = shared[cl]) != 0){
+    shared[cl] = p->s.next;
+    p->s.next = c->free[cl];
+    c->free[cl] = p;
+    c->n[cl]++;
+  }
+  release();
+}
+
+// Return half of thread cache c's list of class cl to the shared list.
+static void
+drain(struct cache *c, int cl)
+{
+  Header *p;
+
+  acquire();
+  while(c->n[cl] > CACHEMAX/2){
+    p = c->free[cl];
+    c->free[cl] = p->s.next;
+    c->n[cl]--;
+    p->s.next = shared[cl];
+    shared[cl] = p;
+  }
+  release();
+}
+
+void
+free(void *ap)
+{
+  struct cache *c;
+  Header *hp;
+  int cl;
+
+  if(ap == 0)
+    return;
+  hp = (Header*)ap - 1;
+  if(hp->s.size > (MINBLOCK << (NCLASS-1))){
+    acquire();
+    freerun(hp);
+    release();
+    return;
+  }
+  cl = sizeclass(hp->s.size - sizeof(Header));
+  c = mycache();
+  if(c->n[cl] == CACHEMAX)
+    drain(c, cl);
+  hp->s.next = c->free[cl];
+  c->free[cl] = hp;
+  c->n[cl]++;
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct cache *c;
+  Header *hp;
+  int cl;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
-  }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+  if(nbytes > MAXSMALL){
+    if(nbytes + sizeof(Header) < nbytes)
+      return 0;
+    acquire();
+    hp = allocrun(nbytes + sizeof(Header));
+    release();
+    return hp ? (void*)(hp + 1) : 0;
   }
+  cl = sizeclass(nbytes);
+  c = mycache();
+  if(c->free[cl] == 0)
+    refill(c, cl);
+  if((hp = c->free[cl]) == 0)
+    return 0;
+  c->free[cl] = hp->s.next;
+  c->n[cl]--;
+  return (void*)(hp + 1);
+}
+
+void*
+calloc(uint n, uint size)
+{
+  void *p;
+
+  if(size && n > (uint)-1 / size)
+    return 0;
+  if((p = malloc(n * size)) != 0)
+    memset(p, 0, n * size);
+  return p;
+}
+
+void*
+realloc(void *ap, uint nbytes)
+{
+  uint have;
+  void *p;
+
+  if(ap == 0)
+    return malloc(nbytes);
+  have = ((Header*)ap - 1)->s.size - sizeof(Header);
+  if(nbytes <= have)
+    return ap;
+  if((p = malloc(nbytes)) == 0)
+    return 0;
+  memmove(p, ap, have);
+  free(ap);
+  return p;
 }
@@ -1,5 +1,7 @@
 struct stat;
 struct rtcdate;
+struct memstat;
+struct procmem;
 
 // system calls
 int fork(void);
@@ -37,6 +39,16 @@ int deleteUser(char *);
 int verify(char*, char*);
 int logout(void);
 int chmod(char*, int);
+int largepage(int);
+int shmget(int, uint);
+void* shmat(int);
+int shmdt(void*);
+void* mmap(int, int, int, int, int);
+int munmap(void*, int);
+int thread_stacksize(int);
+int memstat(struct memstat*);
+int procmem(struct procmem*, int);
+int ksm(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -50,5 +62,7 @@ uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
+void* calloc(uint, uint);
+void* realloc(void*, uint);
 int atoi(const char*);
 
@@ -4,6 +4,8 @@
 #include "user.h"
 #include "fs.h"
 #include "fcntl.h"
+#include "mman.h"
+#include "memstat.h"
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
@@ -184,6 +186,8 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+#define NBIG 4096  // 512-byte chunks in writetest1's file, 2MB
+
 void
 writetest1(void)
 {
@@ -197,7 +201,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +221,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != NBIG){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -457,6 +461,52 @@ mem(void)
   }
 }
 
+// size classes, realloc, calloc, and giving big blocks back
+void
+malloctest(void)
+{
+  char *p[64], *top;
+  int i, j;
+
+  printf(1, "malloc test\n");
+  for(i = 0; i < 64; i++){
+    if((p[i] = malloc(i*37 + 1)) == 0){
+      printf(1, "malloc failed\n");
+      exit();
+    }
+    memset(p[i], i, i*37 + 1);
+  }
+  for(i = 0; i < 64; i++)
+    for(j = 0; j < i*37 + 1; j++)
+      if(p[i][j] != i){
+        printf(1, "malloc blocks overlap\n");
+        exit();
+      }
+  p[0] = realloc(p[0], 5000);
+  p[1] = realloc(p[1], 10000);
+  if(p[0][0] != 0 || p[1][37] != 1){
+    printf(1, "realloc lost data\n");
+    exit();
+  }
+  for(i = 0; i < 64; i++)
+    free(p[i]);
+  p[0] = calloc(1000, 10);
+  for(i = 0; i < 10000; i++)
+    if(p[0][i] != 0){
+      printf(1, "calloc not zeroed\n");
+      exit();
+    }
+  free(p[0]);
+  top = sbrk(0);
+  p[0] = malloc(100000);
+  free(p[0]);
+  if(sbrk(0) > top){
+    printf(1, "free kept big block\n");
+    exit();
+  }
+  printf(1, "malloc ok\n");
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -1200,6 +1250,182 @@ bigfile(void)
   printf(1, "bigfile test ok\n");
 }
 
+#define NEXTBLK (NINDIRECT + 256)  // blocks in each of extenttest's files
+
+// Two files written side by side keep taking the disk block the
+// other one wants next, so each soon runs out of extents and goes
+// on through its indirect and then its double-indirect block.
+// Unlinking them frees the extents' runs and the indirect trees.
+void
+extenttest(void)
+{
+  int fd[2], i, j;
+
+  printf(1, "extent test\n");
+
+  for(j = 0; j < 2; j++){
+    name[0] = 'x';
+    name[1] = '0' + j;
+    name[2] = '\0';
+    unlink(name);
+    if((fd[j] = open(name, O_CREATE | O_RDWR)) < 0){
+      printf(1, "create %s failed\n", name);
+      exit();
+    }
+  }
+  for(i = 0; i < NEXTBLK; i++){
+    for(j = 0; j < 2; j++){
+      ((int*)buf)[0] = i;
+      ((int*)buf)[BSIZE/sizeof(int) - 1] = j;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf(1, "write block %d of x%d failed\n", i, j);
+        exit();
+      }
+    }
+  }
+  for(j = 0; j < 2; j++)
+    close(fd[j]);
+
+  for(j = 0; j < 2; j++){
+    name[0] = 'x';
+    name[1] = '0' + j;
+    name[2] = '\0';
+    if((fd[j] = open(name, O_RDONLY)) < 0){
+      printf(1, "open %s failed\n", name);
+      exit();
+    }
+    for(i = 0; i < NEXTBLK; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE){
+        printf(1, "read block %d of %s failed\n", i, name);
+        exit();
+      }
+      if(((int*)buf)[0] != i || ((int*)buf)[BSIZE/sizeof(int) - 1] != j){
+        printf(1, "block %d of %s has wrong data\n", i, name);
+        exit();
+      }
+    }
+    if(read(fd[j], buf, BSIZE) != 0){
+      printf(1, "%s too long\n", name);
+      exit();
+    }
+    close(fd[j]);
+    if(unlink(name) < 0){
+      printf(1, "unlink %s failed\n", name);
+      exit();
+    }
+  }
+
+  printf(1, "extent test ok\n");
+}
+
+#define NHOT 8  // blocks in bcachetest's hot file
+
+// Read bcachetest's hot file.  If check is set, every block
+// must come from the buffer cache.
+void
+hotread(int check)
+{
+  struct memstat m0, m1;
+  int fd, i;
+
+  if((fd = open("bhot", O_RDONLY)) < 0){
+    printf(1, "open bhot failed\n");
+    exit();
+  }
+  memstat(&m0);
+  for(i = 0; i < NHOT; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || ((int*)buf)[0] != i){
+      printf(1, "read bhot block %d failed\n", i);
+      exit();
+    }
+  }
+  memstat(&m1);
+  close(fd);
+  if(check && (m1.bmiss != m0.bmiss || m1.bhit - m0.bhit < NHOT)){
+    printf(1, "bhot not cached: %d hits, %d misses\n",
+           m1.bhit - m0.bhit, m1.bmiss - m0.bmiss);
+    exit();
+  }
+}
+
+// Write an n-block file, reading the hot file every 64 blocks
+// if hot is set.
+void
+bcachefill(char *path, int n, int hot)
+{
+  int fd, i;
+
+  if((fd = open(path, O_CREATE | O_RDWR)) < 0){
+    printf(1, "create %s failed\n", path);
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    ((int*)buf)[0] = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf(1, "write %s failed\n", path);
+      exit();
+    }
+    if(hot && i % 64 == 0)
+      hotread(0);
+  }
+  close(fd);
+}
+
+// A small file read over and over while a file bigger than the
+// buffer cache is written goes on the 2Q Am queue, and stays
+// cached while another file bigger than the cache is read
+// through once, with read-ahead, only cycling through A1.
+void
+bcachetest(void)
+{
+  struct memstat ms;
+  int fd, i, n, cc;
+
+  printf(1, "bcache test\n");
+
+  memstat(&ms);
+  n = ms.total / BCACHEFRAC * (4096/BSIZE) * 5/4;
+  if(2*n > FSSIZE*3/4){
+    printf(1, "bcache test: cache too big for the disk, skipped\n");
+    return;
+  }
+  unlink("bscan");
+  unlink("bhot");
+  unlink("bfill");
+  bcachefill("bscan", n, 0);
+  bcachefill("bhot", NHOT, 0);
+  bcachefill("bfill", n, 1);
+
+  memstat(&ms);
+  if(ms.bhot < NHOT){
+    printf(1, "bcache: only %d reused blocks\n", ms.bhot);
+    exit();
+  }
+  hotread(1);
+
+  if((fd = open("bscan", O_RDONLY)) < 0){
+    printf(1, "open bscan failed\n");
+    exit();
+  }
+  for(i = 0; (cc = read(fd, buf, BSIZE)) == BSIZE; i++){
+    if(((int*)buf)[0] != i){
+      printf(1, "bscan block %d has wrong data\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  if(cc != 0 || i != n){
+    printf(1, "read bscan failed at block %d\n", i);
+    exit();
+  }
+  hotread(1);
+
+  unlink("bscan");
+  unlink("bhot");
+  unlink("bfill");
+  printf(1, "bcache test ok\n");
+}
+
 void
 fourteen(void)
 {
@@ -1546,6 +1772,336 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// heap growth with 4MB pages: grow, fork, shrink part-way
+// into a large page, then grow again.
+void
+largepagetest(void)
+{
+  char *a, *p;
+  int pid, i;
+  uint top;
+
+  printf(stdout, "largepage test\n");
+  largepage(1);
+  a = sbrk(0);
+  top = ((uint)a + 4*1024*1024 - 1) & ~(4*1024*1024 - 1);
+  if(sbrk(top - (uint)a + 8*1024*1024) != a){
+    printf(stdout, "largepage sbrk failed\n");
+    exit();
+  }
+  p = (char*)top;
+  for(i = 0; i < 8*1024*1024; i += 4096){
+    if(p[i] != 0){
+      printf(stdout, "largepage not zeroed\n");
+      exit();
+    }
+    p[i] = i / 4096;
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "largepage fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    for(i = 0; i < 8*1024*1024; i += 4096){
+      if(p[i] != (char)(i / 4096)){
+        printf(stdout, "largepage child sees wrong data\n");
+        exit();
+      }
+      p[i] = 0;
+    }
+    exit();
+  }
+  wait();
+  if(p[4096] != 1){
+    printf(stdout, "largepage child wrote parent memory\n");
+    exit();
+  }
+  // shrink into the middle of the second large page, then regrow
+  sbrk(-(4*1024*1024 - 8192));
+  if(p[4*1024*1024 + 4096] != 1){
+    printf(stdout, "largepage lost data below break\n");
+    exit();
+  }
+  sbrk(4*1024*1024 - 8192);
+  if(p[8*1024*1024 - 4096] != 0){
+    printf(stdout, "largepage regrown memory not zeroed\n");
+    exit();
+  }
+  // a large page reaches past the break; growing into the part
+  // written there must zero it
+  sbrk(4096);
+  p[8*1024*1024 + 8192] = 1;
+  sbrk(8192);
+  if(p[8*1024*1024 + 8192] != 0){
+    printf(stdout, "largepage grown memory not zeroed\n");
+    exit();
+  }
+  sbrk(-(sbrk(0) - a));
+  largepage(0);
+  printf(stdout, "largepage ok\n");
+}
+
+// shared memory: a segment attached before fork() is shared
+// with the child, and outlives the parent's detach.
+void
+shmtest(void)
+{
+  int id, pid;
+  char *a, *b;
+
+  printf(stdout, "shm test\n");
+  if((id = shmget(0x5348, 3*4096)) < 0){
+    printf(stdout, "shmget failed\n");
+    exit();
+  }
+  if((a = shmat(id)) == (char*)-1){
+    printf(stdout, "shmat failed\n");
+    exit();
+  }
+  if(shmat(id) != (char*)-1){
+    printf(stdout, "shmat attached twice\n");
+    exit();
+  }
+  a[0] = 'p';
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "shm fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(a[0] != 'p'){
+      printf(stdout, "shm child sees wrong data\n");
+      exit();
+    }
+    a[3*4096-1] = 'c';
+    // kernel can read from a segment, too
+    if(write(-1, a, 4096) != -1 || pipe((int*)(a + 4096)) != 0){
+      printf(stdout, "shm syscall args rejected\n");
+      exit();
+    }
+    exit();
+  }
+  wait();
+  if(a[3*4096-1] != 'c'){
+    printf(stdout, "shm parent does not see child's write\n");
+    exit();
+  }
+  if(shmdt(a) != 0 || shmdt(a) != -1){
+    printf(stdout, "shmdt failed\n");
+    exit();
+  }
+  // the last detach freed it; a new segment starts out zero
+  id = shmget(0x5348, 4096);
+  b = shmat(id);
+  if(b == (char*)-1 || b[0] != 0){
+    printf(stdout, "shm not freed\n");
+    exit();
+  }
+  shmdt(b);
+  printf(stdout, "shm ok\n");
+}
+
+// mmap: pages come from the file on first touch, MAP_SHARED
+// writes reach the file on munmap and every process mapping it,
+// MAP_PRIVATE ones do not.
+void
+mmaptest(void)
+{
+  int fd, fd1, i, pid;
+  char *a, *b, buf[26];
+
+  printf(stdout, "mmap test\n");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "mmap open failed\n");
+    exit();
+  }
+  for(i = 0; i < 26; i++)
+    buf[i] = 'a' + i;
+  for(i = 0; i < (2*4096 + 100) / 26; i++)
+    write(fd, buf, 26);
+  a = mmap(fd, 0, 3*4096, PROT_READ|PROT_WRITE, MAP_SHARED);
+  if(a == (char*)-1){
+    printf(stdout, "mmap failed\n");
+    exit();
+  }
+  if(a[0] != 'a' || a[4096+1] != 'a' + (4096+1) % 26 || a[3*4096-1] != 0){
+    printf(stdout, "mmap read wrong data\n");
+    exit();
+  }
+  a[5] = 'X';
+  pid = fork();
+  if(pid == 0){
+    if(a[5] != 'X' || a[27] != 'b'){
+      printf(stdout, "mmap child sees wrong data\n");
+      exit();
+    }
+    a[8] = 'Z';
+    exit();
+  }
+  wait();
+  if(a[8] != 'Z'){
+    printf(stdout, "mmap child write not shared\n");
+    exit();
+  }
+  b = mmap(fd, 0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED);
+  if(b == (char*)-1 || b[8] != 'Z'){
+    printf(stdout, "mmap second mapping sees wrong data\n");
+    exit();
+  }
+  b[9] = 'W';
+  munmap(b, 4096);
+  if(a[9] != 'W'){
+    printf(stdout, "mmap second mapping write not shared\n");
+    exit();
+  }
+  // the kernel can write into a mapped page, too
+  fd1 = open("mmapfile", O_RDONLY);
+  if(read(fd1, a + 4096, 4) != 4){
+    printf(stdout, "mmap read() into mapping failed\n");
+    exit();
+  }
+  close(fd1);
+  if(munmap(a, 3*4096) != 0){
+    printf(stdout, "munmap failed\n");
+    exit();
+  }
+  a = mmap(fd, 0, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+  if(a == (char*)-1 || a[5] != 'X' || a[4096-1] != 'a' + 4095 % 26){
+    printf(stdout, "mmap shared write lost\n");
+    exit();
+  }
+  a[6] = 'Y';
+  munmap(a, 4096);
+  close(fd);
+  fd = open("mmapfile", O_RDONLY);
+  read(fd, buf, 10);
+  if(buf[5] != 'X' || buf[8] != 'Z' || buf[9] != 'W'){
+    printf(stdout, "mmap shared write lost\n");
+    exit();
+  }
+  if(buf[6] != 'g'){
+    printf(stdout, "mmap private write reached file\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapfile");
+  printf(stdout, "mmap ok\n");
+}
+
+// same-page merging: two children that asked for it and have the
+// same heap contents get those pages merged, and a write then
+// gives the writer a private copy again.
+void
+ksmtest(void)
+{
+  struct memstat ms;
+  int i, j, pid[2], fds[2][2], done[2];
+  char *a, c;
+
+  printf(stdout, "ksm test\n");
+  if(pipe(done) != 0){
+    printf(stdout, "ksm pipe failed\n");
+    exit();
+  }
+  for(i = 0; i < 2; i++){
+    if(pipe(fds[i]) != 0){
+      printf(stdout, "ksm pipe failed\n");
+      exit();
+    }
+    pid[i] = fork();
+    if(pid[i] < 0){
+      printf(stdout, "ksm fork failed\n");
+      exit();
+    }
+    if(pid[i] == 0){
+      ksm(1);
+      a = sbrk(8*4096);
+      for(j = 0; j < 8; j++)
+        memset(a + j*4096, 'a' + j, 4096);
+      read(fds[i][0], &c, 1);
+      if(i == 0)
+        a[0] = 'Z';
+      if(a[0] != (i == 0 ? 'Z' : 'a') || a[1] != 'a' || a[4096] != 'b'){
+        printf(stdout, "ksm child %d sees wrong data\n", i);
+        c = 'x';
+      }
+      write(done[1], &c, 1);
+      exit();
+    }
+  }
+  // the scanner runs while CPUs are idle
+  for(i = 0; i < 100; i++){
+    memstat(&ms);
+    if(ms.ksm > 0)
+      break;
+    sleep(10);
+  }
+  if(ms.ksm == 0){
+    printf(stdout, "ksm pages not merged\n");
+    exit();
+  }
+  // child 0 writes a merged page; child 1 must not see it
+  for(i = 0; i < 2; i++){
+    write(fds[i][1], "g", 1);
+    if(read(done[0], &c, 1) != 1 || c == 'x'){
+      printf(stdout, "ksm write not private\n");
+      exit();
+    }
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  wait();
+  wait();
+  close(done[0]);
+  close(done[1]);
+  printf(stdout, "ksm ok\n");
+}
+
+// swap: grow the heap a megabyte at a time past the free memory,
+// so that pages of this and other processes go out to swap, then
+// check that every page comes back in with its contents.
+void
+swaptest(void)
+{
+  struct memstat ms;
+  uint i, n;
+  char *a, *p;
+
+  printf(stdout, "swap test\n");
+  memstat(&ms);
+  if(ms.swaptotal - ms.swap < 256){
+    printf(stdout, "swap test: no swap space, skipped\n");
+    return;
+  }
+  n = ms.free + (ms.swaptotal - ms.swap) / 2;
+  a = sbrk(0);
+  for(i = 0; i < n; i++){
+    if(i % 256 == 0 && sbrk(256*4096) == (char*)-1){
+      printf(stdout, "swap sbrk failed at page %d of %d\n", i, n);
+      exit();
+    }
+    p = a + i*4096;
+    *(uint*)p = i;
+    p[4095] = i;
+  }
+  memstat(&ms);
+  if(ms.swap == 0){
+    printf(stdout, "swap test: nothing went out to swap\n");
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    p = a + i*4096;
+    if(*(uint*)p != i || p[4095] != (char)i){
+      printf(stdout, "swap page %d came back wrong\n", i);
+      exit();
+    }
+  }
+  sbrk(-(sbrk(0) - a));
+  printf(stdout, "swap ok\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1768,6 +2324,11 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  largepagetest();
+  shmtest();
+  mmaptest();
+  ksmtest();
+  swaptest();
   validatetest();
 
   opentest();
@@ -1780,6 +2341,7 @@ main(int argc, char *argv[])
   iputtest();
 
   mem();
+  malloctest();
   pipe1();
   preempt();
   exitwait();
@@ -1787,6 +2349,8 @@ main(int argc, char *argv[])
   rmdot();
   fourteen();
   bigfile();
+  extenttest();
+  bcachetest();
   subdir();
   linktest();
   unlinkread();
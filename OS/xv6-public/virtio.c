@@ -0,0 +1,295 @@
+// Driver for a virtio block device, through the legacy PCI
+// interface.  When QEMU provides one (make qemu VIRTIO=1), it is
+// the file system disk in place of IDE disk 1; ide.c hands it the
+// requests.
+//
+// Requests go on a single virtqueue.  Each takes a chain of three
+// descriptors: a header with the operation and sector, the buf's
+// data, and a status byte the device fills in.  Requests can be
+// in flight for as long as there are descriptors left, and the
+// device may finish them in any order.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "pci.h"
+
+#define VIRTIO_VENDOR  0x1AF4
+#define VIRTIO_BLK     0x1001  // legacy block device
+
+// Legacy registers, at vdisk.iobase.
+#define VIO_GFEATURES  0x04  // features the driver uses
+#define VIO_QADDR      0x08  // queue's page frame number
+#define VIO_QSIZE      0x0C
+#define VIO_QSEL       0x0E
+#define VIO_QNOTIFY    0x10
+#define VIO_STATUS     0x12
+#define VIO_ISR        0x13  // reading acknowledges the interrupt
+#define VIO_CAPACITY   0x14  // disk size in sectors, low word
+
+// VIO_STATUS bits.
+#define VS_ACK         1
+#define VS_DRIVER      2
+#define VS_DRIVER_OK   4
+#define VS_FAILED      128
+
+#define VQ_MAX         1024  // largest queue we take on
+
+// A descriptor: one buffer of a request.
+struct vdesc {
+  uint addr;
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+#define VD_NEXT        1  // chain continues at next
+#define VD_WRITE       2  // device writes the buffer
+
+struct vavail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vused {
+  ushort flags;
+  ushort idx;
+  struct {
+    uint id;             // head descriptor of the request
+    uint len;
+  } ring[];
+};
+
+// A request, kept at the index of its head descriptor.
+// The first four words are the header the device reads.
+struct vreq {
+  uint type;
+  uint reserved;
+  uint sector;
+  uint sectorhi;
+  uchar status;          // 0 once done
+  struct buf *b;
+};
+#define VR_IN          0  // read
+#define VR_OUT         1  // write
+
+int virtioirq;  // the device's IRQ, 0 if there is none
+
+static struct {
+  struct spinlock lock;
+  ushort iobase;
+  uint qsize;
+  struct vdesc *desc;
+  struct vavail *avail;
+  volatile struct vused *used;
+  struct vreq *req;
+  int freelist;          // free descriptors, through next
+  int nfree;
+  ushort usedidx;        // entries of used taken so far
+  uint capacity;         // in sectors
+} vdisk;
+
+// Bytes of a legacy virtqueue of q entries: descriptors and
+// avail ring, then the used ring on a page of its own.
+static uint
+vringsize(uint q)
+{
+  return PGROUNDUP(16*q + 6 + 2*q) + PGROUNDUP(6 + 8*q);
+}
+
+// Find and set up the device.  Returns 1 if there is one.
+int
+virtioinit(void)
+{
+  struct pcidev *d;
+  uint q, size;
+  ushort io;
+  char *mem;
+  int i, order;
+
+  if((d = pcifindid(VIRTIO_VENDOR, VIRTIO_BLK)) == 0 || (d->bar[0] & 1) == 0)
+    return 0;
+  initlock(&vdisk.lock, "virtio");
+  pcimaster(d);
+  io = vdisk.iobase = d->bar[0] & ~3;
+
+  outb(io + VIO_STATUS, 0);  // reset
+  outb(io + VIO_STATUS, VS_ACK);
+  outb(io + VIO_STATUS, VS_ACK|VS_DRIVER);
+  outl(io + VIO_GFEATURES, 0);
+
+  outw(io + VIO_QSEL, 0);
+  q = inw(io + VIO_QSIZE);
+  size = vringsize(q) + q*sizeof(struct vreq);
+  for(order = 0; (PGSIZE << order) < size; order++)
+    ;
+  if(q == 0 || q > VQ_MAX || order > MAXORDER ||
+     (mem = kalloc_order(order)) == 0){
+    outb(io + VIO_STATUS, VS_FAILED);
+    return 0;
+  }
+  memset(mem, 0, PGSIZE << order);
+  vdisk.qsize = q;
+  vdisk.desc = (struct vdesc*)mem;
+  vdisk.avail = (struct vavail*)(mem + 16*q);
+  vdisk.used = (struct vused*)(mem + PGROUNDUP(16*q + 6 + 2*q));
+  vdisk.req = (struct vreq*)(mem + vringsize(q));
+  for(i = 0; i < q; i++)
+    vdisk.desc[i].next = i + 1;
+  vdisk.freelist = 0;
+  vdisk.nfree = q;
+  outl(io + VIO_QADDR, V2P(mem) / PGSIZE);
+
+  vdisk.capacity = inl(io + VIO_CAPACITY);
+  if(inl(io + VIO_CAPACITY + 4) != 0)
+    vdisk.capacity = 0xFFFFFFFF;
+  outb(io + VIO_STATUS, VS_ACK|VS_DRIVER|VS_DRIVER_OK);
+
+  virtioirq = d->irq;
+  ioapicenable(virtioirq, ncpu - 1);
+  return 1;
+}
+
+static void
+vdesc(int i, void *p, uint len, int flags, int next)
+{
+  vdisk.desc[i].addr = V2P(p);
+  vdisk.desc[i].addrhi = 0;
+  vdisk.desc[i].len = len;
+  vdisk.desc[i].flags = flags;
+  vdisk.desc[i].next = next;
+}
+
+// Put a request for b on the queue; the device hears of it at
+// the next notify.  Caller must hold vdisk.lock.
+static void
+vstart(struct buf *b)
+{
+  struct vreq *r;
+  int d[3], i, write;
+
+  if(!holdingsleep(&b->lock))
+    panic("virtio: buf not locked");
+  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+    panic("virtio: nothing to do");
+  if((b->blockno + 1) * (BSIZE/512) > vdisk.capacity)
+    panic("virtio: incorrect blockno");
+
+  while(vdisk.nfree < 3){
+    outw(vdisk.iobase + VIO_QNOTIFY, 0);
+    sleep(&vdisk.nfree, &vdisk.lock);
+  }
+  for(i = 0; i < 3; i++){
+    d[i] = vdisk.freelist;
+    vdisk.freelist = vdisk.desc[d[i]].next;
+  }
+  vdisk.nfree -= 3;
+
+  write = b->flags & B_DIRTY;
+  r = &vdisk.req[d[0]];
+  r->type = write ? VR_OUT : VR_IN;
+  r->reserved = 0;
+  r->sector = b->blockno * (BSIZE/512);
+  r->sectorhi = 0;
+  r->status = 0xFF;
+  r->b = b;
+  vdesc(d[0], r, 16, VD_NEXT, d[1]);
+  vdesc(d[1], b->data, BSIZE, VD_NEXT | (write ? 0 : VD_WRITE), d[2]);
+  vdesc(d[2], &r->status, 1, VD_WRITE, 0);
+
+  vdisk.avail->ring[vdisk.avail->idx % vdisk.qsize] = d[0];
+  __sync_synchronize();
+  vdisk.avail->idx++;
+}
+
+// Return the descriptor chain starting at i to the free list.
+static void
+vfree(int i)
+{
+  int flags, next;
+
+  for(;;){
+    flags = vdisk.desc[i].flags;
+    next = vdisk.desc[i].next;
+    vdisk.desc[i].next = vdisk.freelist;
+    vdisk.freelist = i;
+    vdisk.nfree++;
+    if((flags & VD_NEXT) == 0)
+      break;
+    i = next;
+  }
+}
+
+void
+virtiointr(void)
+{
+  struct vreq *r;
+  struct buf *b;
+  int id;
+
+  acquire(&vdisk.lock);
+  inb(vdisk.iobase + VIO_ISR);
+
+  while(vdisk.usedidx != vdisk.used->idx){
+    __sync_synchronize();
+    id = vdisk.used->ring[vdisk.usedidx % vdisk.qsize].id;
+    vdisk.usedidx++;
+    r = &vdisk.req[id];
+    if(r->status != 0)
+      panic("virtio: request failed");
+    b = r->b;
+    vfree(id);
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC)
+      bdone(b);
+    else
+      wakeup(b);
+  }
+  wakeup(&vdisk.nfree);
+
+  release(&vdisk.lock);
+}
+
+// The iderw() contract, for the virtio disk.
+void
+virtiorw(struct buf *b)
+{
+  acquire(&vdisk.lock);
+  vstart(b);
+  outw(vdisk.iobase + VIO_QNOTIFY, 0);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &vdisk.lock);
+  release(&vdisk.lock);
+}
+
+// The idesubmit() contract: queue all n, notify once.
+void
+virtiosubmit(struct buf **b, int n)
+{
+  int i;
+
+  acquire(&vdisk.lock);
+  for(i = 0; i < n; i++)
+    vstart(b[i]);
+  outw(vdisk.iobase + VIO_QNOTIFY, 0);
+  release(&vdisk.lock);
+}
+
+void
+virtioiowait(struct buf *b)
+{
+  acquire(&vdisk.lock);
+  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+    sleep(b, &vdisk.lock);
+  release(&vdisk.lock);
+}
@@ -5,11 +5,16 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "traps.h"
 #include "elf.h"
+#include "memstat.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
 
+#define LPGORDER (PDXSHIFT - PTXSHIFT)  // kalloc_order() of a 4MB page
+#define NINVLPG  32  // flushtlb() reloads %cr3 above this many pages
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void
@@ -32,20 +37,23 @@ seginit(void)
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page table pages.
-static pte_t *
+// If va lies in a 4MB page, the PDE itself is returned
+// and has PTE_PS set.
+pte_t *
 walkpgdir(pde_t *pgdir, const void *va, int alloc)
 {
   pde_t *pde;
   pte_t *pgtab;
 
   pde = &pgdir[PDX(va)];
+  if(*pde & PTE_PS)
+    return pde;
   if(*pde & PTE_P){
     pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
   } else {
-    if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
+    // kzalloc makes sure all those PTE_P bits are zero.
+    if(!alloc || (pgtab = (pte_t*)kzalloc()) == 0)
       return 0;
-    // Make sure all those PTE_P bits are zero.
-    memset(pgtab, 0, PGSIZE);
     // The permissions here are overly generous, but they can
     // be further restricted by the permissions in the page table
     // entries, if necessary.
@@ -57,7 +65,7 @@ walkpgdir(pde_t *pgdir, const void *va, int alloc)
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 {
   char *a, *last;
@@ -92,13 +100,14 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //   KERNBASE..KERNBASE+EXTMEM: mapped to 0..EXTMEM (for I/O space)
 //   KERNBASE+EXTMEM..data: mapped to EXTMEM..V2P(data)
 //                for the kernel's instructions and r/o data
-//   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
+//   data..KERNBASE+phystop: mapped to V2P(data)..phystop,
 //                                  rw data + free physical memory
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
 // The kernel allocates physical memory for its heap and for user memory
-// between V2P(end) and the end of physical memory (PHYSTOP)
-// (directly addressable from end..P2V(PHYSTOP)).
+// between V2P(end) and the end of physical memory (phystop, found
+// by kalloc.c) (directly addressable from end..P2V(phystop)).
+// Whole 4MB stretches are mapped with 4MB pages.
 
 // This table defines the kernel's mappings, which are present in
 // every process's page table.
@@ -110,38 +119,65 @@ static struct kmap {
 } kmap[] = {
  { (void*)KERNBASE, 0,             EXTMEM,    PTE_W}, // I/O space
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
- { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
+ { (void*)data,     V2P(data),     0,         PTE_W}, // kern data+memory
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
 };
 
+// Map [va, va+size) to pa in kpgdir, using 4MB pages where
+// va and pa are both 4MB-aligned.
+static int
+mapkern(char *va, uint size, uint pa, int perm)
+{
+  uint n;
+
+  for(; size > 0; va += n, pa += n, size -= n){
+    if((uint)va % LPGSIZE == 0 && pa % LPGSIZE == 0 && size >= LPGSIZE){
+      n = LPGSIZE;
+      kpgdir[PDX(va)] = pa | perm | PTE_P | PTE_PS;
+      continue;
+    }
+    n = LPGSIZE - (uint)va % LPGSIZE;
+    if(n > size)
+      n = size;
+    if(mappages(kpgdir, va, n, pa, perm) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 // Set up kernel part of a page table.
+// The kernel's page-table pages are built once, in kpgdir, and
+// shared: a new page directory just copies the PDEs above KERNBASE.
 pde_t*
 setupkvm(void)
 {
   pde_t *pgdir;
-  struct kmap *k;
 
-  if((pgdir = (pde_t*)kalloc()) == 0)
+  if((pgdir = (pde_t*)kzalloc()) == 0)
     return 0;
-  memset(pgdir, 0, PGSIZE);
-  if (P2V(PHYSTOP) > (void*)DEVSPACE)
-    panic("PHYSTOP too high");
-  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
-    if(mappages(pgdir, k->virt, k->phys_end - k->phys_start,
-                (uint)k->phys_start, k->perm) < 0) {
-      freevm(pgdir);
-      return 0;
-    }
+  memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+          (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
   return pgdir;
 }
 
 // Allocate one page table for the machine for the kernel address
-// space for scheduler processes.
+// space for scheduler processes, along with the kernel
+// page-table pages that setupkvm() shares with every process.
+// The kernel mappings are the same in every address space, so
+// they are marked global and survive %cr3 loads in the TLB.
 void
 kvmalloc(void)
 {
-  kpgdir = setupkvm();
-  switchkvm();
+  struct kmap *k;
+
+  if((kpgdir = (pde_t*)kzalloc()) == 0)
+    panic("kvmalloc");
+  kmap[2].phys_end = phystop;
+  for(k = kmap; k < &kmap[NELEM(kmap)]; k++)
+    if(mapkern(k->virt, k->phys_end - k->phys_start,
+               (uint)k->phys_start, k->perm | PTE_G) < 0)
+      panic("kvmalloc: mappages");
+  lcr3(V2P(kpgdir));  // no struct cpu to record it in yet
 }
 
 // Switch h/w page table register to the kernel-only page table,
@@ -149,7 +185,10 @@ kvmalloc(void)
 void
 switchkvm(void)
 {
+  pushcli();
+  mycpu()->pgdir = kpgdir;  // before %cr3: see flushtlb()
   lcr3(V2P(kpgdir));   // switch to the kernel page table
+  popcli();
 }
 
 // Switch TSS and h/w page table to correspond to process p.
@@ -182,10 +221,81 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
+  mycpu()->pgdir = p->pgdir;  // before %cr3: see flushtlb()
   lcr3(V2P(p->pgdir));  // switch to process's address space
   popcli();
 }
 
+// Flush the TLB entries for [va, va+len) after their PTEs in
+// pgdir changed, on every CPU that has pgdir loaded.  Here, a few
+// pages are flushed one by one with invlpg; a bigger range reloads
+// %cr3, which still keeps the global kernel entries.  Other CPUs,
+// such as ones running sibling threads, get a T_TLBFLUSH interrupt
+// and are waited for, since the caller may be about to free the
+// pages.
+void
+flushtlb(pde_t *pgdir, uint va, uint len)
+{
+  struct cpu *c;
+  uint a;
+
+  pushcli();
+  if(mycpu()->pgdir == pgdir){
+    if(len > NINVLPG*PGSIZE)
+      lcr3(V2P(pgdir));
+    else
+      for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE)
+        invlpg((void*)a);
+  }
+  // A CPU switching to pgdir records it before loading %cr3, so
+  // one that is not seen here loads the new PTEs.
+  __sync_synchronize();
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c != mycpu() && c->pgdir == pgdir){
+      c->tlbflush = 1;
+      lapicipi(c->apicid, T_TLBFLUSH);
+    }
+  }
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c->tlbflush)
+      tlbcheck();  // another CPU may be flushing us meanwhile
+  popcli();
+}
+
+// Flush this CPU's user TLB entries if another CPU's flushtlb()
+// asked for it.  Interrupts must be off.
+void
+tlbcheck(void)
+{
+  struct cpu *c = mycpu();
+
+  if(c->tlbflush){
+    lcr3(rcr3());
+    c->tlbflush = 0;
+  }
+}
+
+#if !defined(MULTILEVEL_SCHED) && !defined(MLFQ_SCHED)
+// Switch to the current thread of p.  If this CPU already has p's
+// page table loaded, as when going from one thread to a sibling,
+// only the kernel stack in the TSS changes; %cr3 is not reloaded,
+// so the TLB is kept.
+void
+switchthd(struct proc *p)
+{
+  pushcli();
+  if(mycpu()->pgdir != p->pgdir){
+    popcli();
+    switchuvm(p);
+    return;
+  }
+  if(CURTHD(p)->kstack == 0)
+    panic("switchthd: no kstack");
+  mycpu()->ts.esp0 = (uint)CURTHD(p)->kstack + KSTACKSIZE;
+  popcli();
+}
+#endif
+
 // Load the initcode into address 0 of pgdir.
 // sz must be less than a page.
 void
@@ -195,8 +305,7 @@ inituvm(pde_t *pgdir, char *init, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
   memmove(mem, init, sz);
 }
@@ -227,26 +336,51 @@ loaduvm(pde_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
 
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// If large is set, each 4MB-aligned region the growth enters that
+// has no page table yet is mapped whole by one PTE_PS page; the
+// part of it above newsz stays mapped for later growth, which
+// zeroes it again since the user could write it meanwhile.
 int
-allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
+allocuvm(pde_t *pgdir, uint oldsz, uint newsz, int large)
 {
   char *mem;
-  uint a;
+  pde_t *pde;
+  uint a, s, e;
 
-  if(newsz >= KERNBASE)
+  if(newsz > USERTOP)
     return 0;
   if(newsz < oldsz)
     return oldsz;
 
   a = PGROUNDUP(oldsz);
   for(; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    pde = &pgdir[PDX(a)];
+    if(*pde & PTE_PS){
+      // Already backed by a large page: zero the part of it
+      // in [oldsz, newsz).
+      s = PGADDR(PDX(a), 0, 0);
+      e = s + LPGSIZE;
+      if(s < oldsz)
+        s = oldsz;
+      if(e > newsz)
+        e = newsz;
+      memset(P2V(PTE_ADDR(*pde)) + s % LPGSIZE, 0, e - s);
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if(large && a % LPGSIZE == 0 && !(*pde & PTE_P) &&
+       (mem = kalloc_order(LPGORDER)) != 0){
+      memset(mem, 0, LPGSIZE);
+      *pde = V2P(mem) | PTE_P | PTE_W | PTE_U | PTE_PS;
+      a += LPGSIZE - PGSIZE;
+      continue;
+    }
+    mem = swapalloc();
     if(mem == 0){
       cprintf("allocuvm out of memory\n");
       deallocuvm(pgdir, newsz, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
       cprintf("allocuvm out of memory (2)\n");
       deallocuvm(pgdir, newsz, oldsz);
@@ -257,6 +391,58 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   return newsz;
 }
 
+// Map zeroed pages over the holes in [va, va+len), a page-aligned
+// range that is not part of the process size, such as a thread
+// stack.  Returns 0, or -1 with [va, va+len) left unmapped.
+int
+uvmmap(pde_t *pgdir, uint va, uint len)
+{
+  pte_t *pte;
+  char *mem;
+  uint a;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte && (*pte & (PTE_P|PTE_SWAP)))
+      continue;
+    if((mem = swapalloc()) == 0)
+      goto bad;
+    if(mappages(pgdir, (char*)a, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+      kfree(mem);
+      goto bad;
+    }
+  }
+  return 0;
+
+bad:
+  deallocuvm(pgdir, a, va);
+  return -1;
+}
+
+// Give back the part of the 4MB page mapped by *pde that lies at
+// or above a, by turning the page into a page table of 4KB pages
+// and freeing the ones from a upward.  If no page is free for the
+// page table, the tail stays mapped; allocuvm zeroes it if the
+// process grows into it again.
+static void
+splitlarge(pde_t *pde, uint a)
+{
+  pte_t *pgtab;
+  uint i, pa, flags;
+
+  pa = PTE_ADDR(*pde);
+  if((pgtab = (pte_t*)kzalloc()) == 0)
+    return;
+  flags = PTE_FLAGS(*pde) & ~PTE_PS;
+  for(i = 0; i < NPTENTRIES; i++){
+    if(i < PTX(a))
+      pgtab[i] = (pa + i*PGSIZE) | flags;
+    else
+      kfree(P2V(pa + i*PGSIZE));
+  }
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -273,14 +459,28 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
     pte = walkpgdir(pgdir, (char*)a, 0);
-    if(!pte)
+    if(pte && (*pte & PTE_PS)){
+      if(a % LPGSIZE == 0){
+        kfree_order(P2V(PTE_ADDR(*pte)), LPGORDER);
+        *pte = 0;
+      } else
+        splitlarge(pte, a);
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+    }
+    else if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
     else if((*pte & PTE_P) != 0){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
-      char *v = P2V(pa);
-      kfree(v);
+      if(*pte & PTE_KSM)
+        ksmput(pa);
+      else
+        kfree(P2V(pa));
+      *pte = 0;
+    }
+    else if(*pte & PTE_SWAP){
+      swapfree(*pte);
       *pte = 0;
     }
   }
@@ -288,7 +488,8 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
 }
 
 // Free a page table and all the physical memory pages
-// in the user part.
+// in the user part.  The kernel's page-table pages are
+// shared with kpgdir and are left alone.
 void
 freevm(pde_t *pgdir)
 {
@@ -296,8 +497,9 @@ freevm(pde_t *pgdir)
 
   if(pgdir == 0)
     panic("freevm: no pgdir");
+  shmexit(pgdir);
   deallocuvm(pgdir, KERNBASE, 0);
-  for(i = 0; i < NPDENTRIES; i++){
+  for(i = 0; i < PDX(KERNBASE); i++){
     if(pgdir[i] & PTE_P){
       char * v = P2V(PTE_ADDR(pgdir[i]));
       kfree(v);
@@ -319,33 +521,93 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
-// Given a parent process's page table, create a copy
-// of it for a child.
-pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+// Copy the pages of [va, end) in pgdir into d.  If sparse is
+// set, the range may have holes.  Returns 0, or -1 if memory ran
+// out; the caller frees d.
+static int
+copyrange(pde_t *pgdir, pde_t *d, uint va, uint end, int sparse)
 {
-  pde_t *d;
   pte_t *pte;
-  uint pa, i, flags;
+  uint pa, i, flags, base;
   char *mem;
 
-  if((d = setupkvm()) == 0)
-    return 0;
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
+  for(i = va; i < end; i += PGSIZE){
+    pte = walkpgdir(pgdir, (void *) i, 0);
+    if(sparse && pte == 0){
+      // No page table: skip the whole 4MB.
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    if(sparse && !(*pte & (PTE_P|PTE_SWAP)))
+      continue;
+    if(pte == 0)
       panic("copyuvm: pte should exist");
+    if((*pte & PTE_SWAP) && swapin(pgdir, i) < 0)
+      return -1;
     if(!(*pte & PTE_P))
       panic("copyuvm: page not present");
-    pa = PTE_ADDR(*pte);
+    pa = base = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto bad;
+    if(*pte & PTE_PS){
+      if(i % LPGSIZE == 0 && (mem = kalloc_order(LPGORDER)) != 0){
+        memmove(mem, (char*)P2V(pa), LPGSIZE);
+        d[PDX(i)] = V2P(mem) | flags;
+        i += LPGSIZE - PGSIZE;
+        continue;
+      }
+      // No 4MB block free: copy it into 4KB pages.
+      pa += i % LPGSIZE;
+      flags &= ~PTE_PS;
+    }
+    if(flags & PTE_KSM){
+      // Merged: share it with the child too.
+      if(ksmdup(pa) == 0){
+        if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0){
+          ksmput(pa);
+          return -1;
+        }
+        continue;
+      }
+      // Unmerged meanwhile: copy it like any other page.
+      flags = (flags & ~PTE_KSM) | PTE_W;
+    }
+    if((mem = swapalloc()) == 0)
+      return -1;
+    if(!(*pte & PTE_P) || PTE_ADDR(*pte) != base){
+      // While swapalloc() slept, the page went out to swap
+      // or was merged: start it over.
+      kfree(mem);
+      i -= PGSIZE;
+      continue;
+    }
     memmove(mem, (char*)P2V(pa), PGSIZE);
     if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags) < 0) {
       kfree(mem);
-      goto bad;
+      return -1;
     }
   }
+  return 0;
+}
+
+// Given a parent process's page table, create a copy of it for
+// a child: the memory below sz and, if tstack is not 0, the
+// tstack[i] bytes mapped at the top of each thread stack window.
+pde_t*
+copyuvm(pde_t *pgdir, uint sz, uint *tstack)
+{
+  pde_t *d;
+  int i;
+
+  if((d = setupkvm()) == 0)
+    return 0;
+  if(copyrange(pgdir, d, 0, sz, 0) < 0)
+    goto bad;
+  for(i = 0; tstack && i < NTHREAD; i++)
+    if(tstack[i] && copyrange(pgdir, d, TSTACKWIN(i) - tstack[i],
+                              TSTACKWIN(i), 1) < 0)
+      goto bad;
+  if(shmfork(pgdir, d) < 0)
+    goto bad;
   return d;
 
 bad:
@@ -365,9 +627,75 @@ uva2ka(pde_t *pgdir, char *uva)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
+  if(*pte & PTE_PS)
+    return (char*)P2V(PTE_ADDR(*pte)) + (uint)uva % LPGSIZE;
   return (char*)P2V(PTE_ADDR(*pte));
 }
 
+// Count the user pages and page-table pages of pgdir into *pm.
+void
+uvmstat(pde_t *pgdir, struct procmem *pm)
+{
+  pte_t *pgtab;
+  uint i, j;
+
+  pm->rss = pm->shm = pm->swap = pm->pgtab = 0;
+  for(i = 0; i < PDX(KERNBASE); i++){
+    if(!(pgdir[i] & PTE_P))
+      continue;
+    if(pgdir[i] & PTE_PS){
+      pm->rss += NPTENTRIES;
+      continue;
+    }
+    pm->pgtab++;
+    pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[i]));
+    for(j = 0; j < NPTENTRIES; j++){
+      if(pgtab[j] & PTE_P){
+        pm->rss++;
+        if(pgtab[j] & PTE_SHM)
+          pm->shm++;
+      } else if(pgtab[j] & PTE_SWAP)
+        pm->swap++;
+    }
+  }
+  pm->pgtab++;  // the page directory itself
+}
+
+// Number of page-table pages in the kernel's part of the address
+// space, which every page directory shares.
+uint
+kvmpgtab(void)
+{
+  uint i, n;
+
+  n = 1;  // kpgdir
+  for(i = PDX(KERNBASE); i < NPDENTRIES; i++)
+    if((kpgdir[i] & (PTE_P|PTE_PS)) == PTE_P)
+      n++;
+  return n;
+}
+
+// Are the len bytes at user address va all mapped for the user,
+// and writable if write is set?  For addresses the process size
+// does not vouch for, such as shared memory segments.
+int
+uvmcheck(pde_t *pgdir, uint va, uint len, int write)
+{
+  pte_t *pte;
+  uint a;
+
+  if(va + len < va || va + len > KERNBASE)
+    return 0;
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(pte == 0 || (*pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+      return 0;
+    if(write && !(*pte & PTE_W))
+      return 0;
+  }
+  return 1;
+}
+
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
 // uva2ka ensures this only works for PTE_U pages.